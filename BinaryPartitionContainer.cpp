@@ -1,140 +1,276 @@
 #include "BinaryPartitionContainer.h"
+#include <algorithm>
 #include <cmath>
+#include "morton.h"
 
-BinaryPartitionContainer::Iterator::Iterator(BinaryPartitionContainer &c, Particle &p, float r) : c(c), p(p), i(0), r(r)
+BinaryPartitionContainer::Iterator::Iterator(BinaryPartitionContainer &c, int p, float r) : c(c), r(r), i(0), end(0), top(0)
+{
+    x = c.store->px[p];
+    y = c.store->py[p];
+    if (!c.nodes.empty())
+        stack[top++] = 0;
+    seek();
+}
+
+void BinaryPartitionContainer::Iterator::seek()
 {
-    to_visit.push(c.root);
     for (;;)
     {
-        i = 0;
-        if (!to_visit.front()->q[0] && !to_visit.front()->q[1] && !to_visit.front()->q[2] && !to_visit.front()->q[3])
+        while (++i < end)
+        {
+            int j = c.indices[i];
+            float dx = c.store->px[j] - x;
+            float dy = c.store->py[j] - y;
+            if ((dx*dx+dy*dy)<(r*r))
+                return;
+        }
+
+        if (top == 0)
+            return;
+        const Node& node = c.nodes[stack[--top]];
+
+        if (node.child[0] < 0)
         {
-            while (i < to_visit.front()->d.size())
-            {
-                float dx = c.vec()[i].px - p.px;
-                float dy = c.vec()[i].py - p.py;
-                if ((dx*dx+dy*dy)<(r*r))
-                    break;
-                ++i;
-            }
-            to_visit.pop();
+            i = node.begin - 1;
+            end = node.end;
+            continue;
         }
 
-        for (auto& quad : to_visit.front()->q)
+        for (int k=0; k<4 && node.child[k] >= 0; k++)
         {
-            if (abs(quad->center.first - p.px) < quad->radius + r && abs(quad->center.second - p.py) < quad->radius + r)
-                to_visit.push(quad);
+            // inclusive so rounding can't prune a particle on the edge of both the node and the radius
+            const Node& sub = c.nodes[node.child[k]];
+            if (sub.begin < sub.end && std::fabs(sub.cx - x) <= sub.hx + r && std::fabs(sub.cy - y) <= sub.hy + r)
+                stack[top++] = node.child[k];
         }
-        to_visit.pop();
     }
 }
 
 int BinaryPartitionContainer::Iterator::idx()
 {
-    return to_visit.front()->d[i];
+    return c.indices[i];
 }
 
-Particle& BinaryPartitionContainer::Iterator::operator*()
+bool BinaryPartitionContainer::Iterator::done()
 {
-    return c.vec()[idx()];
+    return i >= end;
 }
 
-bool BinaryPartitionContainer::Iterator::done()
+BinaryPartitionContainer::Iterator& BinaryPartitionContainer::Iterator::operator++()
 {
-    return to_visit.empty();
+    seek();
+    return *this;
 }
 
-BinaryPartitionContainer::Iterator& BinaryPartitionContainer::Iterator::operator++()
+BinaryPartitionContainer::Iterator BinaryPartitionContainer::nearest(int i, float r)
 {
-    if (++i < to_visit.front()->d.size())
-        return *this;
+    return Iterator(*this, i, r);
+}
 
-    i = 0;
-    to_visit.pop();
-    for (;;)
+void BinaryPartitionContainer::update(const ParticleStore& s, float r)
+{
+    store = &s;
+    int n = s.size();
+
+    // clearing keeps the capacity, so after the first few steps the rebuild doesn't allocate
+    nodes.clear();
+    indices.resize(n);
+    scratch.resize(n);
+    quadrants.resize(n);
+    for (int i=0; i<n; i++)
+        indices[i] = i;
+
+    // make new root
+    nodes.push_back({0.0f, 0.0f, 1.0f, 1.0f, {-1, -1, -1, -1}, 0, n});
+
+    // repartition
+    if (n > MAX_PARTITION)
+        divide(0, r, 0);
+    collect_leaves();
+}
+
+void BinaryPartitionContainer::divide(int node, float r, int depth)
+{
+    // copies since adding children can reallocate nodes
+    float cx = nodes[node].cx;
+    float cy = nodes[node].cy;
+    float new_r = nodes[node].hx / 2;
+    int begin = nodes[node].begin;
+    int end = nodes[node].end;
+
+    // particles on a dividing line go to the upper or right quadrant so none are dropped
+    int counts[4] = {0, 0, 0, 0};
+    for (int k=begin; k<end; k++)
     {
-        if (!to_visit.front()->q[0] && !to_visit.front()->q[1] && !to_visit.front()->q[2] && !to_visit.front()->q[3])
-        {
-            while (i < to_visit.front()->d.size())
-            {
-                float dx = c.vec()[i].px - p.px;
-                float dy = c.vec()[i].py - p.py;
-                if ((dx*dx+dy*dy)<(r*r))
-                    break;
-                ++i;
-            }
-            to_visit.pop();
-        }
+        float px = store->px[indices[k]];
+        float py = store->py[indices[k]];
+        int q = py >= cy ? (px >= cx ? 0 : 1) : (px < cx ? 2 : 3);
+        quadrants[k] = q;
+        ++counts[q];
+    }
 
-        for (auto& quad : to_visit.front()->q)
-        {
-            if (abs(quad->center.first - p.px) < quad->radius + r && abs(quad->center.second - p.py) < quad->radius + r)
-                to_visit.push(quad);
-        }
-        to_visit.pop();
+    // counting sort the node's range by quadrant
+    int starts[4];
+    starts[0] = begin;
+    for (int q=1; q<4; q++)
+        starts[q] = starts[q - 1] + counts[q - 1];
+    int next[4] = {starts[0], starts[1], starts[2], starts[3]};
+    for (int k=begin; k<end; k++)
+        scratch[next[quadrants[k]]++] = indices[k];
+    std::copy(scratch.begin() + begin, scratch.begin() + end, indices.begin() + begin);
+
+    int first = nodes.size();
+    for (int q=0; q<4; q++)
+        nodes[node].child[q] = first + q;
+    nodes.push_back({cx + new_r, cy + new_r, new_r, new_r, {-1, -1, -1, -1}, starts[0], starts[0] + counts[0]});
+    nodes.push_back({cx - new_r, cy + new_r, new_r, new_r, {-1, -1, -1, -1}, starts[1], starts[1] + counts[1]});
+    nodes.push_back({cx - new_r, cy - new_r, new_r, new_r, {-1, -1, -1, -1}, starts[2], starts[2] + counts[2]});
+    nodes.push_back({cx + new_r, cy - new_r, new_r, new_r, {-1, -1, -1, -1}, starts[3], starts[3] + counts[3]});
+
+    for (int q=0; q<4; q++)
+    {
+        if (new_r > r && counts[q] > MAX_PARTITION && depth + 1 < MAX_TREE_DEPTH)
+            divide(first + q, r, depth + 1);
     }
+}
 
-    return *this;
+/// Cell of a coordinate at TREE_CODE_BITS resolution, clamped to [-1, 1]
+static uint32_t tree_coord(float x)
+{
+    const float cells = 1 << TREE_CODE_BITS;
+    float c = (x + 1.0f) * (cells / 2);
+    if (!(c > 0.0f))
+        return 0;
+    return std::min(static_cast<uint32_t>(c), static_cast<uint32_t>(cells) - 1);
 }
 
-void BinaryPartitionContainer::update(float r)
+void BinaryPartitionContainer::update(const ParticleStore& s, float r, ThreadPool& pool)
 {
-    // remove partitions
-    delete root;
+    store = &s;
+    int n = s.size();
 
-    // make new root
-    root = new Node(*this);
-    root->radius = 1.0;
-    root->center = {0.0, 0.0};
-    for (int i=0; i<particles.size(); i++)
-        root->d.push_back(i);
+    // internal nodes first with the root at 0, then one leaf per particle
+    nodes.resize(n > 0 ? 2 * n - 1 : 0);
+    indices.resize(n);
+    codes.resize(n);
 
-    // repartition
-    root->divide(r);
+    pool.parallel_for(n, [&](int begin, int end, int) {
+        for (int i=begin; i<end; i++)
+        {
+            codes[i] = morton_encode(tree_coord(s.px[i]), tree_coord(s.py[i]));
+            indices[i] = i;
+        }
+    }, "Tree codes");
+
+    // stable, so equal codes stay in index order
+    sorter.sort(codes, indices, pool);
+
+    // every node is independent given the sorted codes
+    pool.parallel_for(n, [&](int begin, int end, int) {
+        for (int k=begin; k<end; k++)
+            set_cell(nodes[n - 1 + k], 2 * TREE_CODE_BITS, k, k);
+    }, "Tree leaves");
+    pool.parallel_for(n - 1, [&](int begin, int end, int) {
+        for (int i=begin; i<end; i++)
+            emit_internal(i, r);
+    }, "Tree nodes");
+    collect_leaves();
+}
+
+int BinaryPartitionContainer::common_prefix(int a, int b) const
+{
+    if (b < 0 || b >= static_cast<int>(codes.size()))
+        return -1;
+    uint32_t x = codes[a] ^ codes[b];
+    if (x != 0)
+        return __builtin_clz(x);
+    return 2 * TREE_CODE_BITS + __builtin_clz(static_cast<uint32_t>(a ^ b));
 }
 
-void BinaryPartitionContainer::Node::divide(float r)
+void BinaryPartitionContainer::emit_internal(int i, float r)
 {
-    Node* q1 = new Node(c);
-    q1->center = {center.first + radius/2, center.first + radius/2};
-    Node* q2 = new Node(c);
-    q2->center = {center.first - radius/2, center.first + radius/2};
-    Node* q3 = new Node(c);
-    q3->center = {center.first - radius/2, center.first - radius/2};
-    Node* q4 = new Node(c);
-    q4->center = {center.first + radius/2, center.first - radius/2};
-    float new_r = radius/2;
-    q1->radius = new_r;
-    q2->radius = new_r;
-    q3->radius = new_r;
-    q4->radius = new_r;
-
-    q[0] = q1;
-    q[1] = q2;
-    q[2] = q3;
-    q[3] = q4;
-    for (const auto& idx : d)
+    int n = codes.size();
+
+    // the node's range extends from i towards the neighbor sharing the longer prefix
+    int d = common_prefix(i, i + 1) - common_prefix(i, i - 1) >= 0 ? 1 : -1;
+    int prefix_min = common_prefix(i, i - d);
+
+    // find the other end with an exponential then a binary search
+    int l_max = 2;
+    while (common_prefix(i, i + l_max * d) > prefix_min)
+        l_max *= 2;
+    int l = 0;
+    for (int t = l_max / 2; t >= 1; t /= 2)
     {
-        const auto& part = c.vec()[idx];
-        if (part.px > center.first && part.py > center.second)
-            q1->d.push_back(idx);
-        if (part.px < center.first && part.py > center.second)
-            q2->d.push_back(idx);
-        if (part.px < center.first && part.py < center.second)
-            q3->d.push_back(idx);
-        if (part.px > center.first && part.py < center.second)
-            q4->d.push_back(idx);
+        if (common_prefix(i, i + (l + t) * d) > prefix_min)
+            l += t;
     }
+    int j = i + l * d;
+    int prefix = common_prefix(i, j);
 
-    for (auto& quad : q)
+    // the split is the last position sharing more than the node's prefix with i
+    int s = 0;
+    int t = l;
+    do
     {
-        if (quad->radius > r && quad->d.size() > MAX_PARTITION)
-            quad->divide(r);
-    }
+        t = (t + 1) / 2;
+        if (common_prefix(i, i + (s + t) * d) > prefix)
+            s += t;
+    } while (t > 1);
+    int split = i + s * d + std::min(d, 0);
+
+    int first = std::min(i, j);
+    int last = std::max(i, j);
+    Node& node = nodes[i];
+    set_cell(node, std::min(prefix, 2 * TREE_CODE_BITS), first, last);
+
+    // small or narrow nodes are scanned whole like the leaves of the serial build, and so are
+    // particles sharing a code since splitting them can't skip anything but makes the tree deeper
+    // than the traversal stack allows
+    if (last - first + 1 <= MAX_PARTITION || (node.hx <= r && node.hy <= r) || prefix >= 2 * TREE_CODE_BITS)
+        return;
+    node.child[0] = first == split ? n - 1 + split : split;
+    node.child[1] = last == split + 1 ? n - 1 + split + 1 : split + 1;
+}
+
+void BinaryPartitionContainer::set_cell(Node& node, int prefix, int first, int last)
+{
+    // codes interleave from the top as y, x, y, x, ... so y gets the extra bit of an odd prefix
+    int bits_y = (prefix + 1) / 2;
+    int bits_x = prefix / 2;
+    uint32_t code = codes[first];
+    uint32_t size_x = 1u << (TREE_CODE_BITS - bits_x);
+    uint32_t size_y = 1u << (TREE_CODE_BITS - bits_y);
+    uint32_t x = morton_compact(code) & ~(size_x - 1);
+    uint32_t y = morton_compact(code >> 1) & ~(size_y - 1);
+
+    const float scale = 2.0f / (1 << TREE_CODE_BITS);
+    node.hx = size_x * scale / 2;
+    node.hy = size_y * scale / 2;
+    node.cx = x * scale - 1.0f + node.hx;
+    node.cy = y * scale - 1.0f + node.hy;
+    for (int k=0; k<4; k++)
+        node.child[k] = -1;
+    node.begin = first;
+    node.end = last + 1;
 }
 
-BinaryPartitionContainer::Node::~Node()
+void BinaryPartitionContainer::collect_leaves()
 {
-    for (Node* quad : q)
-        delete quad;
-}
\ No newline at end of file
+    leaves.clear();
+    if (nodes.empty())
+        return;
+
+    // nodes below a leaf of the parallel build are never reached, so walk down from the root
+    int stack[TRAVERSAL_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        int node = stack[--top];
+        if (nodes[node].child[0] < 0)
+            leaves.push_back(node);
+        for (int k=0; k<4 && nodes[node].child[k] >= 0; k++)
+            stack[top++] = nodes[node].child[k];
+    }
+}
@@ -2,55 +2,222 @@
 #define FLUIDSIM_BINARYPARTITIONCONTAINER_H
 
 #include "ParticleContainer.h"
+#include "RadixSort.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <vector>
-#include <queue>
 
 constexpr int MAX_PARTITION = 64;
 
+// deepest level a node is divided to, bounds the traversal stack below
+constexpr int MAX_TREE_DEPTH = 20;
+
+// nodes pending in a search, each level deeper leaves at most 3 siblings waiting
+constexpr int TRAVERSAL_STACK = 64;
+
+// below this many particles the serial build is faster than the parallel one on any thread count,
+// which also loses on a single thread, see BM_TreeBuild
+constexpr int TREE_PARALLEL_MIN = 1 << 15;
+
+// bits per axis of the Morton codes the parallel build sorts by
+constexpr int TREE_CODE_BITS = 16;
+
+/// A quadtree over [-1, 1] stored as flat arrays that are reused by every update
+///
+/// Particle indices are sorted so every node covers a contiguous range of them. The serial update
+/// divides top down into quadrants, the parallel update builds a binary radix tree over Morton codes
+/// where every node splits its cell in half along one axis.
 class BinaryPartitionContainer : public ParticleContainer
 {
     struct Node {
-        Node* q[4]; // 4 quadrants
-        std::vector<int> d; // indices of particles
-        std::pair<float, float> center;
-        float radius;
-        BinaryPartitionContainer& c;
-
-        /// Split the node into four quadrants and appropriately subdivide
-        void divide(float r);
-        ~Node();
-        Node(BinaryPartitionContainer& c) : c(c) {
-            q[0] = nullptr;
-            q[1] = nullptr;
-            q[2] = nullptr;
-            q[3] = nullptr;
-        }
+        float cx, cy;
+        // half the width and height
+        float hx, hy;
+        // children, -1 past the last one so a leaf has none
+        int child[4];
+        // range of the node's particles in indices
+        int begin, end;
     };
 
+    std::vector<Node> nodes;
+    // particle indices sorted by leaf
+    std::vector<int> indices;
+    // scratch for partitioning a node's particles into quadrants
+    std::vector<int> scratch;
+    std::vector<unsigned char> quadrants;
+    // Morton code of each particle, sorted for the parallel build along with indices
+    std::vector<uint32_t> codes;
+    RadixSort sorter;
+    // leaves reachable from the root, the blocks of for_each_neighbor_block
+    std::vector<int> leaves;
+
+    /// Split a node into four quadrants and appropriately subdivide
+    void divide(int node, float r, int depth);
+
+    /// Length of the common prefix of the codes at two sorted positions, -1 outside the range
+    ///
+    /// Equal codes are told apart by their positions so every prefix in the tree is unique
+    int common_prefix(int a, int b) const;
+
+    /// Fills in the radix tree node splitting the range around sorted position i
+    void emit_internal(int i, float r);
+
+    /// Fills in a node for the cell of a Morton prefix and the sorted range [first, last]
+    void set_cell(Node& node, int prefix, int first, int last);
+
+    /// Lists the leaves reachable from the root, which split indices between them
+    void collect_leaves();
+
 public:
     class Iterator {
         BinaryPartitionContainer& c;
-        Particle& p;
+        float x, y;
         float r;
-        Iterator(BinaryPartitionContainer& c, Particle& p, float r);
-        int i;
-        std::queue<Node *> to_visit;
+        Iterator(BinaryPartitionContainer& c, int p, float r);
+        // position in indices and end of the leaf being scanned
+        int i, end;
+        // nodes overlapping the search radius still to be visited
+        int stack[TRAVERSAL_STACK];
+        int top;
+        /// Skip forward to the next particle within the radius
+        void seek();
     public:
-        virtual Iterator& operator++();
-        Particle& operator*();
+        Iterator& operator++();
         bool done();
         friend BinaryPartitionContainer;
         int idx();
     };
 
     /// Recomputes the binary partition
-    void update(float r);
+    void update(const ParticleStore& s, float r);
+
+    /// Recomputes the partition bottom up from sorted Morton codes, in parallel on the pool
+    ///
+    /// Nodes holding at most MAX_PARTITION particles or no wider than r are searched as leaves
+    void update(const ParticleStore& s, float r, ThreadPool& pool);
+
+    BinaryPartitionContainer::Iterator nearest(int i, float r);
+
+    /// Calls f(j) for every particle j within r of particle i, i itself included, leaf by leaf
+    template <typename F>
+    void for_each_neighbor(int i, float r, F&& f) const;
 
-    BinaryPartitionContainer() : root(nullptr) {}
+    /// Number of blocks for for_each_neighbor_block, one per leaf
+    int block_count() const;
 
-private:
-    // root node
-    Node* root;
+    /// Calls f(i, j) for every particle i in a leaf and every particle j within r of it
+    ///
+    /// The tree is walked once for the bounding box of the leaf's particles, and each particle of the
+    /// leaves it reaches is tested against the whole block. Each i sees its neighbors in the same
+    /// order as for_each_neighbor.
+    template <typename F>
+    void for_each_neighbor_block(int leaf, float r, F&& f) const;
 };
 
+template <typename F>
+void BinaryPartitionContainer::for_each_neighbor(int i, float r, F&& f) const
+{
+    if (nodes.empty())
+        return;
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* idx = indices.data();
+    float x = px[i];
+    float y = py[i];
+
+    // nodes overlapping the search radius still to be visited
+    int stack[TRAVERSAL_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const Node& node = nodes[stack[--top]];
+        if (node.child[0] < 0)
+        {
+            for (int k = node.begin; k < node.end; k++)
+            {
+                int j = idx[k];
+                float dx = px[j] - x;
+                float dy = py[j] - y;
+                if ((dx*dx+dy*dy)<(r*r))
+                    f(j);
+            }
+            continue;
+        }
+
+        for (int k=0; k<4 && node.child[k] >= 0; k++)
+        {
+            // inclusive so rounding can't prune a particle on the edge of both the node and the radius
+            const Node& sub = nodes[node.child[k]];
+            if (sub.begin < sub.end && std::fabs(sub.cx - x) <= sub.hx + r && std::fabs(sub.cy - y) <= sub.hy + r)
+                stack[top++] = node.child[k];
+        }
+    }
+}
+
+inline int BinaryPartitionContainer::block_count() const
+{
+    return leaves.size();
+}
+
+template <typename F>
+void BinaryPartitionContainer::for_each_neighbor_block(int leaf, float r, F&& f) const
+{
+    const Node& block = nodes[leaves[leaf]];
+    if (block.begin == block.end)
+        return;
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* idx = indices.data();
+
+    float x_min = px[idx[block.begin]], x_max = x_min;
+    float y_min = py[idx[block.begin]], y_max = y_min;
+    for (int m = block.begin + 1; m < block.end; m++)
+    {
+        x_min = std::min(x_min, px[idx[m]]);
+        x_max = std::max(x_max, px[idx[m]]);
+        y_min = std::min(y_min, py[idx[m]]);
+        y_max = std::max(y_max, py[idx[m]]);
+    }
+
+    int stack[TRAVERSAL_STACK];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const Node& node = nodes[stack[--top]];
+        if (node.child[0] < 0)
+        {
+            for (int k = node.begin; k < node.end; k++)
+            {
+                int j = idx[k];
+                float x = px[j];
+                float y = py[j];
+                for (int m = block.begin; m < block.end; m++)
+                {
+                    int i = idx[m];
+                    float dx = x - px[i];
+                    float dy = y - py[i];
+                    if ((dx*dx+dy*dy)<(r*r))
+                        f(i, j);
+                }
+            }
+            continue;
+        }
+
+        for (int k=0; k<4 && node.child[k] >= 0; k++)
+        {
+            // the distance from the box to its nearest particle is the one the per particle test computes,
+            // so this keeps every node that test would
+            const Node& sub = nodes[node.child[k]];
+            float dx = sub.cx < x_min ? x_min - sub.cx : (sub.cx > x_max ? sub.cx - x_max : 0.0f);
+            float dy = sub.cy < y_min ? y_min - sub.cy : (sub.cy > y_max ? sub.cy - y_max : 0.0f);
+            if (sub.begin < sub.end && dx <= sub.hx + r && dy <= sub.hy + r)
+                stack[top++] = node.child[k];
+        }
+    }
+}
+
 #endif
@@ -0,0 +1,57 @@
+#include "FrameScheduler.h"
+#include <algorithm>
+
+bool FrameScheduler::run(Simulation& sim)
+{
+    Clock::time_point now = Clock::now();
+    double elapsed = started ? std::chrono::duration<double>(now - last_frame).count() : 0.0;
+    last_frame = now;
+    started = true;
+    frame_steps = 0;
+
+    // nothing is owed while paused, so resuming doesn't rush to catch up
+    if (sim.paused)
+    {
+        lag = 0.0;
+        skipped = 0;
+        skipped_before_draw = 0;
+        return true;
+    }
+
+    lag = std::min<double>(max_lag, lag + elapsed * speed);
+    Clock::time_point deadline = now + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double, std::milli>(budget_ms));
+
+    // at least one step whenever time is owed, so the simulation moves however small the budget
+    while (lag > 0.0 && (frame_steps == 0 || Clock::now() < deadline))
+    {
+        sim.phys_update();
+        lag -= sim.get_step_timestep();
+        ++frame_steps;
+    }
+
+    // still behind, so skip drawing this frame and get to the next frame's physics sooner
+    if (lag > 0.0 && skipped < max_skipped_frames)
+    {
+        ++skipped;
+        return false;
+    }
+    skipped_before_draw = skipped;
+    skipped = 0;
+    return true;
+}
+
+int FrameScheduler::get_frame_steps() const
+{
+    return frame_steps;
+}
+
+double FrameScheduler::get_lag() const
+{
+    return std::max(0.0, lag);
+}
+
+int FrameScheduler::get_skipped_frames() const
+{
+    return skipped_before_draw;
+}
@@ -0,0 +1,55 @@
+#ifndef FLUIDSIM_FRAMESCHEDULER_H
+#define FLUIDSIM_FRAMESCHEDULER_H
+
+#include <chrono>
+#include "simulation.h"
+
+/// Advances a simulation along with the wall clock from a render loop
+///
+/// Every frame owes the simulated time that passed since the last one, scaled by speed, and steps are taken
+/// until it is paid or the frame's physics budget runs out. Time still owed carries over up to max_lag, and
+/// while behind the caller is told to skip drawing and presenting the frame, so the time it would spend on
+/// the GUI and waiting for vsync goes to physics instead. A single step longer than the budget still holds
+/// up its frame.
+class FrameScheduler
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point last_frame;
+    bool started;
+    // simulated seconds owed to the wall clock, negative when a step went past it
+    double lag;
+    // frames skipped in a row, and how many were skipped before the last drawn one
+    int skipped;
+    int skipped_before_draw;
+    // steps taken by the last frame
+    int frame_steps;
+
+public:
+    // the default speed matches the two 0.005 steps per frame at 60 Hz the window used to take
+    FrameScheduler() : started(false), lag(0.0), skipped(0), skipped_before_draw(0), frame_steps(0), speed(0.6f),
+        budget_ms(12.0f), max_lag(0.1f), max_skipped_frames(3) {}
+
+    /// Takes the steps due since the last call, returns whether the frame should be drawn
+    bool run(Simulation& sim);
+
+    /// Steps taken by the last run
+    int get_frame_steps() const;
+
+    /// Simulated seconds the simulation is behind the wall clock
+    double get_lag() const;
+
+    /// Frames skipped in a row before the last one drawn
+    int get_skipped_frames() const;
+
+    // simulated seconds per wall clock second
+    float speed;
+    // wall clock milliseconds of physics per frame
+    float budget_ms;
+    // simulated seconds of lag carried over, the rest is dropped so a stall doesn't snowball
+    float max_lag;
+    // frames skipped in a row at most while behind
+    int max_skipped_frames;
+};
+
+#endif
@@ -0,0 +1,236 @@
+#include "GridContainer.h"
+#include <algorithm>
+#include <cmath>
+#include "morton.h"
+
+int GridContainer::grid_dim(float r)
+{
+    if (!(r > 2.0f / MAX_GRID_DIM))
+        return MAX_GRID_DIM;
+    // cells a sliver wider than r, so neighbors are never more than one cell away even after rounding in coord
+    return std::max(1, static_cast<int>(std::floor(2.0f / (r * GRID_CELL_MARGIN))));
+}
+
+int GridContainer::key_of(int i) const
+{
+    return coord(store->py[i]) * dim + coord(store->px[i]);
+}
+
+void GridContainer::update(const ParticleStore& s, float r)
+{
+    int new_dim = grid_dim(r);
+    bool rebuild = !incremental || &s != store || new_dim != dim || s.size() != keys.size() ||
+                   cell_end.size() != new_dim * new_dim;
+    store = &s;
+    dim = new_dim;
+    cell_size = 2.0f / dim;
+    if (rebuild || !move_changed())
+        bin();
+}
+
+void GridContainer::set_incremental(bool enabled)
+{
+    // the next update rebins so cells get their spare room, or lose it
+    if (enabled != incremental)
+        cell_end.clear();
+    incremental = enabled;
+}
+
+void GridContainer::bin()
+{
+    int cells = dim * dim;
+
+    // count particles per cell
+    cell_start.assign(cells + 1, 0);
+    cell_end.assign(cells, 0);
+    keys.resize(store->size());
+    slot_of.resize(store->size());
+    for (int i=0; i<store->size(); i++)
+    {
+        keys[i] = key_of(i);
+        ++cell_end[keys[i]];
+    }
+
+    // prefix sum gives the start of each cell, with room to grow in incremental mode
+    int sum = 0;
+    for (int cell=0; cell<cells; cell++)
+    {
+        cell_start[cell] = sum;
+        sum += cell_end[cell];
+        if (incremental)
+            sum += cell_end[cell] / 4 + GRID_CELL_SLACK;
+        cell_end[cell] = cell_start[cell];
+    }
+    cell_start[cells] = sum;
+
+    // scatter, leaving each cell_end one past its last particle
+    sorted.resize(sum);
+    for (int i=0; i<store->size(); i++)
+    {
+        slot_of[i] = cell_end[keys[i]]++;
+        sorted[slot_of[i]] = i;
+    }
+}
+
+bool GridContainer::move_changed()
+{
+    int limit = static_cast<int>(store->size() * GRID_REBUILD_FRACTION);
+    movers.clear();
+    for (int i=0; i<store->size(); i++)
+    {
+        if (key_of(i) == keys[i])
+            continue;
+        if (movers.size() >= limit)
+            return false;
+        movers.push_back(i);
+    }
+
+    for (int i : movers)
+    {
+        int to = key_of(i);
+        if (cell_end[to] == cell_start[to + 1])
+            return false;
+
+        // fill the hole with the last particle of the old cell
+        int from = keys[i];
+        int last = sorted[--cell_end[from]];
+        sorted[slot_of[i]] = last;
+        slot_of[last] = slot_of[i];
+
+        slot_of[i] = cell_end[to]++;
+        sorted[slot_of[i]] = i;
+        keys[i] = to;
+    }
+    return true;
+}
+
+void GridContainer::sort_morton(ParticleStore& s, ThreadPool& pool)
+{
+    store = &s;
+    int n = s.size();
+    codes.resize(n);
+    order.resize(n);
+    pool.parallel_for(n, [&](int begin, int end, int) {
+        for (int i=begin; i<end; i++)
+        {
+            codes[i] = morton_encode(coord(s.px[i]), coord(s.py[i]));
+            order[i] = i;
+        }
+    }, "Morton codes");
+
+    // the sort is stable so equal codes stay in index order, and only covers the bits a cell can set
+    int bits = 0;
+    while ((1 << bits) < dim)
+        ++bits;
+    sorter.sort(codes, order, pool, 2 * bits);
+
+    s.reorder(order);
+    bin();
+}
+
+GridContainer::Iterator GridContainer::nearest(int i, float r)
+{
+    return Iterator(*this, i, r);
+}
+
+int GridContainer::cell_count() const
+{
+    return cell_end.size();
+}
+
+int GridContainer::cells_per_axis() const
+{
+    return dim;
+}
+
+const int* GridContainer::begin_of(int cell) const
+{
+    return sorted.data() + cell_start[cell];
+}
+
+const int* GridContainer::end_of(int cell) const
+{
+    return sorted.data() + cell_end[cell];
+}
+
+void GridContainer::candidates(int i, float r, std::vector<int>& out) const
+{
+    cell_candidates(key_of(i), r, out);
+}
+
+void GridContainer::cell_candidates(int cell, float r, std::vector<int>& out) const
+{
+    int reach = this->reach(r);
+    int px = cell % dim;
+    int py = cell / dim;
+    int cx_max = std::min(dim - 1, px + reach);
+    int cy_max = std::min(dim - 1, py + reach);
+    for (int cy = std::max(0, py - reach); cy <= cy_max; cy++)
+    {
+        for (int cx = std::max(0, px - reach); cx <= cx_max; cx++)
+        {
+            int other = cy * dim + cx;
+            out.insert(out.end(), sorted.begin() + cell_start[other], sorted.begin() + cell_end[other]);
+        }
+    }
+}
+
+GridContainer::Iterator::Iterator(GridContainer &c, int p, float r) : c(c), radius(r), i(0), end(0)
+{
+    x = c.store->px[p];
+    y = c.store->py[p];
+
+    int reach = c.reach(r);
+    int px = c.coord(x);
+    int py = c.coord(y);
+    cx_min = std::max(0, px - reach);
+    cx_max = std::min(c.dim - 1, px + reach);
+    cy_max = std::min(c.dim - 1, py + reach);
+    cx = cx_min - 1;
+    cy = std::max(0, py - reach);
+    seek();
+}
+
+void GridContainer::Iterator::seek()
+{
+    for (;;)
+    {
+        while (i < end)
+        {
+            int j = c.sorted[i];
+            float dx = c.store->px[j] - x;
+            float dy = c.store->py[j] - y;
+            if ((dx*dx+dy*dy)<(radius*radius))
+                return;
+            ++i;
+        }
+
+        // move to the next cell in the block
+        if (++cx > cx_max)
+        {
+            cx = cx_min;
+            if (++cy > cy_max)
+                return;
+        }
+        int cell = cy * c.dim + cx;
+        i = c.cell_start[cell];
+        end = c.cell_end[cell];
+    }
+}
+
+GridContainer::Iterator& GridContainer::Iterator::operator++()
+{
+    ++i;
+    seek();
+    return *this;
+}
+
+bool GridContainer::Iterator::done()
+{
+    return cy > cy_max;
+}
+
+int GridContainer::Iterator::idx()
+{
+    return c.sorted[i];
+}
@@ -0,0 +1,237 @@
+#ifndef FLUIDSIM_GRIDCONTAINER_H
+#define FLUIDSIM_GRIDCONTAINER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "ParticleContainer.h"
+#include "RadixSort.h"
+#include "ThreadPool.h"
+
+// upper bound on cells per axis so tiny radii don't allocate huge grids
+constexpr int MAX_GRID_DIM = 1024;
+
+// cells are at least this many times the search radius wide
+constexpr float GRID_CELL_MARGIN = 1.0001f;
+
+// spare slots every cell gets in incremental mode, on top of a quarter of its particles
+constexpr int GRID_CELL_SLACK = 2;
+
+// fraction of particles changing cells above which an incremental update rebins everything instead
+constexpr float GRID_REBUILD_FRACTION = 0.2f;
+
+/// A particle container binning particles into a dense grid of cells over [-1, 1]
+///
+/// Particles are counting sorted by cell so each cell is a contiguous range of indices. In incremental
+/// mode every cell keeps spare room after its range, and updates only move the particles that changed cells.
+class GridContainer : public ParticleContainer
+{
+    // number of cells along each axis
+    int dim;
+    // side length of a cell
+    float cell_size;
+    // cell of each particle
+    std::vector<int> keys;
+    // particle indices sorted by cell
+    std::vector<int> sorted;
+    // range of each cell in sorted, cell_start has one more entry so the room of a cell ends at the next start
+    std::vector<int> cell_start;
+    std::vector<int> cell_end;
+    // position of each particle in sorted
+    std::vector<int> slot_of;
+    // particles that changed cells in an incremental update
+    std::vector<int> movers;
+    bool incremental;
+    // scratch for Morton sorting
+    std::vector<uint32_t> codes;
+    std::vector<int> order;
+    RadixSort sorter;
+
+    /// Cell coordinate along one axis, clamped to the grid
+    int coord(float x) const;
+
+    /// Cell a particle currently lies in
+    int key_of(int i) const;
+
+    /// Counting sorts particles into the current cells
+    void bin();
+
+    /// Moves the particles whose cell changed, false if too many moved or a cell ran out of room
+    bool move_changed();
+
+public:
+    class Iterator {
+        GridContainer& c;
+        float x, y;
+        float radius;
+        // block of cells being scanned
+        int cx_min, cx_max, cy_max;
+        int cx, cy;
+        // position in sorted and end of the current cell
+        int i, end;
+        Iterator(GridContainer& c, int p, float r);
+        /// Skip forward to the next particle within the radius
+        void seek();
+    public:
+        Iterator& operator++();
+        bool done();
+        friend GridContainer;
+        int idx();
+    };
+
+    GridContainer() : dim(1), cell_size(2.0f), incremental(false) {}
+
+    /// Number of cells along each axis for a given search radius
+    ///
+    /// Cells are at least r wide, so a search only visits the 3x3 cells around a particle unless r is
+    /// below the MAX_GRID_DIM resolution
+    static int grid_dim(float r);
+
+    GridContainer::Iterator nearest(int i, float r);
+
+    int cell_count() const;
+
+    /// Number of cells along each axis
+    int cells_per_axis() const;
+
+    /// Cells on each side of a particle's own that a search of radius r has to scan, 1 unless r is below
+    /// the grid resolution
+    int reach(float r) const;
+
+    /// Indices of the particles in a cell, as a range [begin_of, end_of)
+    const int* begin_of(int cell) const;
+    const int* end_of(int cell) const;
+
+    /// Appends every particle in the cells covering radius r around particle i
+    ///
+    /// Unlike nearest this doesn't filter by distance, so the result includes farther particles and i itself
+    void candidates(int i, float r, std::vector<int>& out) const;
+
+    /// Appends every particle in the cells covering radius r around any point of a cell
+    ///
+    /// These are the candidates of each particle in the cell, so they can be gathered once for all of them
+    void cell_candidates(int cell, float r, std::vector<int>& out) const;
+
+    /// Calls f(j) for every particle j within r of particle i, i itself included, cell by cell
+    template <typename F>
+    void for_each_neighbor(int i, float r, F&& f) const;
+
+    /// Number of blocks for for_each_neighbor_block, one per cell
+    int block_count() const;
+
+    /// Calls f(i, j) for every particle i in a cell and every particle j within r of it
+    ///
+    /// The cells around the block are found once, and each particle in them is tested against the
+    /// whole cell. Each i sees its neighbors in the same order as for_each_neighbor.
+    template <typename F>
+    void for_each_neighbor_block(int cell, float r, F&& f) const;
+
+    /// Rebins all particles into cells at least r wide
+    ///
+    /// Incremental updates of the same store and cell size only move the particles that changed cells
+    void update(const ParticleStore& s, float r);
+
+    /// Keeps spare room in every cell so updates can move particles instead of rebinning all of them
+    ///
+    /// Particles within a cell are no longer in index order once some have moved
+    void set_incremental(bool enabled);
+
+    /// Reorders the store along a Z-order curve of the particles' cells and rebins
+    ///
+    /// Neighbors end up close together in memory, use ParticleStore::slot to follow a particle across reorders
+    void sort_morton(ParticleStore& s, ThreadPool& pool);
+};
+
+inline int GridContainer::coord(float x) const
+{
+    int cx = static_cast<int>((x + 1.0f) / cell_size);
+    return std::min(dim - 1, std::max(0, cx));
+}
+
+inline int GridContainer::reach(float r) const
+{
+    return std::max(1, static_cast<int>(std::ceil(r / cell_size)));
+}
+
+template <typename F>
+void GridContainer::for_each_neighbor(int i, float r, F&& f) const
+{
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* idx = sorted.data();
+    float x = px[i];
+    float y = py[i];
+
+    int reach = this->reach(r);
+    int cell_x = coord(x);
+    int cell_y = coord(y);
+    int cx_min = std::max(0, cell_x - reach);
+    int cx_max = std::min(dim - 1, cell_x + reach);
+    int cy_max = std::min(dim - 1, cell_y + reach);
+    for (int cy = std::max(0, cell_y - reach); cy <= cy_max; cy++)
+    {
+        for (int cx = cx_min; cx <= cx_max; cx++)
+        {
+            int cell = cy * dim + cx;
+            int end = cell_end[cell];
+            for (int k = cell_start[cell]; k < end; k++)
+            {
+                int j = idx[k];
+                float dx = px[j] - x;
+                float dy = py[j] - y;
+                if ((dx*dx+dy*dy)<(r*r))
+                    f(j);
+            }
+        }
+    }
+}
+
+inline int GridContainer::block_count() const
+{
+    return cell_count();
+}
+
+template <typename F>
+void GridContainer::for_each_neighbor_block(int cell, float r, F&& f) const
+{
+    int begin = cell_start[cell];
+    int end = cell_end[cell];
+    if (begin == end)
+        return;
+
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* idx = sorted.data();
+
+    int reach = this->reach(r);
+    int cell_x = cell % dim;
+    int cell_y = cell / dim;
+    int cx_min = std::max(0, cell_x - reach);
+    int cx_max = std::min(dim - 1, cell_x + reach);
+    int cy_max = std::min(dim - 1, cell_y + reach);
+    for (int cy = std::max(0, cell_y - reach); cy <= cy_max; cy++)
+    {
+        for (int cx = cx_min; cx <= cx_max; cx++)
+        {
+            int other = cy * dim + cx;
+            int other_end = cell_end[other];
+            for (int k = cell_start[other]; k < other_end; k++)
+            {
+                int j = idx[k];
+                float x = px[j];
+                float y = py[j];
+                for (int m=begin; m<end; m++)
+                {
+                    int i = idx[m];
+                    float dx = x - px[i];
+                    float dy = y - py[i];
+                    if ((dx*dx+dy*dy)<(r*r))
+                        f(i, j);
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -1,50 +1,125 @@
 #include "HashContainer.h"
+#include <algorithm>
+#include <cmath>
+
+HashContainer::Iterator HashContainer::nearest(int i, float r)
+{
+    return Iterator(*this, i, r);
+}
 
 HashContainer::Iterator &HashContainer::Iterator::operator++()
 {
-    while (c.buckets[i % c.buckets.size()] != -1)
-    {
-        // quadratic probing
-        i += offset++;
-        float dx = c.vec()[c.buckets[i % c.buckets.size()]].px - p.px;
-        float dy = c.vec()[c.buckets[i % c.buckets.size()]].py - p.py;
-        if ((dx*dx+dy*dy)<(radius*radius))
-            break;
-    }
+    seek();
     return *this;
 }
 
 bool HashContainer::Iterator::done()
 {
-    return c.buckets[i] == -1;
+    return current < 0;
 }
 
 int HashContainer::Iterator::idx()
 {
-    return c.buckets[i];
+    return current;
 }
 
-Particle &HashContainer::Iterator::operator*()
+HashContainer::Iterator::Iterator(HashContainer &c, int p, float r) : c(c), radius(r), offset(1), current(-1)
 {
-    return c.vec()[c.buckets[i]];
+    x = c.store->px[p];
+    y = c.store->py[p];
+
+    // cells overlapping the search radius
+    cx_min = c.cell_of(x - r);
+    cx_max = c.cell_of(x + r);
+    cy_max = c.cell_of(y + r);
+    cx = cx_min;
+    cy = c.cell_of(y - r);
+    bucket = c.home(cx, cy);
+    seek();
 }
 
-HashContainer::Iterator::Iterator(HashContainer &c, Particle &p, float r) : c(c), p(p), radius(r), offset(1) {
-    i = p.hash(3*r);
+void HashContainer::Iterator::seek()
+{
+    for (;;)
+    {
+        // the probe sequence of a cell ends at the first unused bucket
+        while (c.buckets[bucket] != -1)
+        {
+            int j = c.buckets[bucket];
+            bucket = (bucket + offset++) & c.mask;
+
+            // other cells can share the sequence, only take particles of this one so none repeat
+            if (c.cell_of(c.store->px[j]) != cx || c.cell_of(c.store->py[j]) != cy)
+                continue;
+            float dx = c.store->px[j] - x;
+            float dy = c.store->py[j] - y;
+            if ((dx*dx+dy*dy)<(radius*radius))
+            {
+                current = j;
+                return;
+            }
+        }
+
+        // move to the next cell in the block
+        if (++cx > cx_max)
+        {
+            cx = cx_min;
+            if (++cy > cy_max)
+            {
+                current = -1;
+                return;
+            }
+        }
+        bucket = c.home(cx, cy);
+        offset = 1;
+    }
 }
 
-void HashContainer::update(float r)
+void HashContainer::update(const ParticleStore& s, float r)
 {
-     // *4 is so load factor is 0.25
-    buckets = std::vector<int>(particles.size()*4, -1);
+    store = &s;
+    // a degenerate radius would put every particle in its own cell
+    cell_size = r > 0.0f ? r : 1.0f;
+
+    // at least 4 buckets per particle so load factor is at most 0.25
+    unsigned int size = 1;
+    while (size < 4u * s.size() || size < 2)
+        size *= 2;
+    mask = size - 1;
+    buckets.assign(size, -1);
+
+    cells.clear();
+    for (int i=0; i<s.size(); i++)
+    {
+        int cx = cell_of(s.px[i]);
+        int cy = cell_of(s.py[i]);
+        unsigned int idx = home(cx, cy);
+        // quadratic probing, a cell is new if none of its particles are on the way
+        unsigned int offset = 1;
+        bool occupied = false;
+        for (int j = buckets[idx]; j != -1; j = buckets[idx])
+        {
+            occupied = occupied || (cell_of(s.px[j]) == cx && cell_of(s.py[j]) == cy);
+            idx = (idx + offset++) & mask;
+        }
+        buckets[idx] = i;
+        if (!occupied)
+            cells.push_back({{cx, cy}});
+    }
 
-    for (int i=0; i<particles.size(); i++)
+    // group the particles of each cell for the blocks, in the order a search walks them
+    cell_particles.clear();
+    cell_begin.assign(1, 0);
+    for (const std::array<int, 2>& cell : cells)
     {
-        const Particle& p = particles[i];
-        int idx = p.hash(r*3);
-        // quadratic probing
-        int offset = 1;
-        while (buckets[idx % buckets.size()] != -1) idx += offset++;
-        buckets[idx % buckets.size()] = i;
+        unsigned int idx = home(cell[0], cell[1]);
+        unsigned int offset = 1;
+        for (int j = buckets[idx]; j != -1; j = buckets[idx])
+        {
+            if (cell_of(s.px[j]) == cell[0] && cell_of(s.py[j]) == cell[1])
+                cell_particles.push_back(j);
+            idx = (idx + offset++) & mask;
+        }
+        cell_begin.push_back(cell_particles.size());
     }
 }
@@ -1,36 +1,180 @@
 #ifndef FLUIDSIM_HASHCONTAINER_H
 #define FLUIDSIM_HASHCONTAINER_H
 
+#include <algorithm>
 #include <vector>
 #include <array>
+#include <cmath>
 #include "ParticleContainer.h"
 
 /// A particle container using a hash to group nearby particles
+///
+/// Particles are placed in an open addressed table by the hash of their cell, so every particle of a
+/// cell lies on the probe sequence starting at that cell's hash
 class HashContainer : public ParticleContainer
 {
     // buckets of indices
     // -1 indicates unused
     std::vector<int> buckets;
+    // table size - 1, the size is a power of two so quadratic probing reaches every bucket
+    unsigned int mask;
+    // side length of a cell
+    float cell_size;
+    // coordinates of every occupied cell, the blocks of for_each_neighbor_block
+    std::vector<std::array<int, 2>> cells;
+    // particles of each occupied cell in probe order, cell k's as the range [cell_begin[k], cell_begin[k + 1])
+    std::vector<int> cell_particles;
+    std::vector<int> cell_begin;
+
+    /// Cell coordinate along one axis
+    int cell_of(float x) const;
+
+    /// First bucket probed for a cell
+    unsigned int home(int cx, int cy) const;
 
 public:
     class Iterator {
-        int i;
-        int offset;
-        float radius;
         HashContainer& c;
-        Particle& p;
-        Iterator(HashContainer& c, Particle& p, float r);
+        float x, y;
+        float radius;
+        // block of cells being scanned
+        int cx_min, cx_max, cy_max;
+        int cx, cy;
+        // next bucket and probe step in the current cell's sequence
+        unsigned int bucket;
+        unsigned int offset;
+        // particle found by the last seek, -1 once done
+        int current;
+        Iterator(HashContainer& c, int p, float r);
+        /// Skip forward to the next particle within the radius
+        void seek();
     public:
-        virtual Iterator& operator++();
-        Particle& operator*();
+        Iterator& operator++();
         bool done();
         friend HashContainer;
         int idx();
     };
 
+    HashContainer() : mask(0), cell_size(1.0f) {}
+
+    HashContainer::Iterator nearest(int i, float r);
+
     /// Rehashes all particles
-    void update(float r);
+    void update(const ParticleStore& s, float r);
+
+    /// Calls f(j) for every particle j within r of particle i, i itself included, cell by cell
+    template <typename F>
+    void for_each_neighbor(int i, float r, F&& f) const;
+
+    /// Number of blocks for for_each_neighbor_block, one per occupied cell
+    int block_count() const;
+
+    /// Calls f(i, j) for every particle i of an occupied cell and every particle j within r of it
+    ///
+    /// Each i sees its neighbors in the same order as for_each_neighbor, but the probe sequence of every
+    /// cell around the block is walked once for all of its particles
+    template <typename F>
+    void for_each_neighbor_block(int block, float r, F&& f) const;
 };
 
+inline int HashContainer::cell_of(float x) const
+{
+    return static_cast<int>(std::floor(x / cell_size));
+}
+
+inline unsigned int HashContainer::home(int cx, int cy) const
+{
+    return ((static_cast<unsigned int>(cx) * 73856093u) ^ (static_cast<unsigned int>(cy) * 19349663u)) & mask;
+}
+
+template <typename F>
+void HashContainer::for_each_neighbor(int i, float r, F&& f) const
+{
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* table = buckets.data();
+    float x = px[i];
+    float y = py[i];
+
+    // cells overlapping the search radius
+    int cx_min = cell_of(x - r);
+    int cx_max = cell_of(x + r);
+    int cy_max = cell_of(y + r);
+    for (int cy = cell_of(y - r); cy <= cy_max; cy++)
+    {
+        for (int cx = cx_min; cx <= cx_max; cx++)
+        {
+            // the probe sequence of a cell ends at the first unused bucket
+            unsigned int bucket = home(cx, cy);
+            unsigned int offset = 1;
+            for (int j = table[bucket]; j != -1; j = table[bucket])
+            {
+                bucket = (bucket + offset++) & mask;
+
+                // other cells can share the sequence, only take particles of this one so none repeat
+                if (cell_of(px[j]) != cx || cell_of(py[j]) != cy)
+                    continue;
+                float dx = px[j] - x;
+                float dy = py[j] - y;
+                if ((dx*dx+dy*dy)<(r*r))
+                    f(j);
+            }
+        }
+    }
+}
+
+inline int HashContainer::block_count() const
+{
+    return cells.size();
+}
+
+template <typename F>
+void HashContainer::for_each_neighbor_block(int block, float r, F&& f) const
+{
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    const int* table = buckets.data();
+    const int* first = cell_particles.data() + cell_begin[block];
+    const int* last = cell_particles.data() + cell_begin[block + 1];
+
+    // the union of the cells each particle's own search would scan
+    float x_min = px[*first], x_max = x_min;
+    float y_min = py[*first], y_max = y_min;
+    for (const int* i = first + 1; i != last; ++i)
+    {
+        x_min = std::min(x_min, px[*i]);
+        x_max = std::max(x_max, px[*i]);
+        y_min = std::min(y_min, py[*i]);
+        y_max = std::max(y_max, py[*i]);
+    }
+    int cx_min = cell_of(x_min - r);
+    int cx_max = cell_of(x_max + r);
+    int cy_max = cell_of(y_max + r);
+    for (int cy = cell_of(y_min - r); cy <= cy_max; cy++)
+    {
+        for (int cx = cx_min; cx <= cx_max; cx++)
+        {
+            unsigned int bucket = home(cx, cy);
+            unsigned int offset = 1;
+            for (int j = table[bucket]; j != -1; j = table[bucket])
+            {
+                bucket = (bucket + offset++) & mask;
+                if (cell_of(px[j]) != cx || cell_of(py[j]) != cy)
+                    continue;
+
+                // every particle of the block is tested against a neighbor while it is loaded
+                float xj = px[j];
+                float yj = py[j];
+                for (const int* i = first; i != last; ++i)
+                {
+                    float dx = xj - px[*i];
+                    float dy = yj - py[*i];
+                    if ((dx*dx+dy*dy)<(r*r))
+                        f(*i, j);
+                }
+            }
+        }
+    }
+}
 
 #endif
@@ -0,0 +1,90 @@
+#include "NeighborList.h"
+#include <algorithm>
+
+bool NeighborList::stale(const ParticleStore& s, float h, float skin, bool half, ThreadPool& pool)
+{
+    if (!valid || s.size() != ref_x.size() || h + skin != radius || skin != this->skin || half != this->half)
+        return true;
+
+    moved.assign(pool.size(), 0.0);
+    pool.parallel_for(s.size(), [&](int begin, int end, int thread) {
+        float worst = 0.0;
+        for (int i=begin; i<end; i++)
+        {
+            float dx = s.px[i] - ref_x[i];
+            float dy = s.py[i] - ref_y[i];
+            worst = std::max(worst, dx*dx + dy*dy);
+        }
+        moved[thread] = worst;
+    }, "List check");
+
+    // two particles each moving half the skin towards each other can close the whole skin
+    float limit = skin / 2;
+    return *std::max_element(moved.begin(), moved.end()) > limit * limit;
+}
+
+void NeighborList::build(const ParticleStore& s, const GridContainer& grid, float h, float skin, bool half, ThreadPool& pool)
+{
+    int n = s.size();
+    radius = h + skin;
+    this->skin = skin;
+    this->half = half;
+    float r_sq = radius * radius;
+
+    offsets.resize(n + 1);
+    local.resize(pool.size());
+    candidates.resize(pool.size());
+    local_base.assign(pool.size() + 1, 0);
+
+    // each thread lists its own range of particles with offsets local to its buffer
+    pool.parallel_for(n, [&](int begin, int end, int thread) {
+        std::vector<int>& out = local[thread];
+        std::vector<int>& nbr = candidates[thread];
+        out.clear();
+        for (int i=begin; i<end; i++)
+        {
+            offsets[i] = out.size();
+            nbr.clear();
+            grid.candidates(i, radius, nbr);
+            for (int j : nbr)
+            {
+                float dx = s.px[j] - s.px[i];
+                float dy = s.py[j] - s.py[i];
+                if ((half ? j > i : j != i) && dx*dx + dy*dy < r_sq)
+                    out.push_back(j);
+            }
+        }
+        local_base[thread + 1] = out.size();
+    }, "List build");
+
+    // thread ranges are in particle order so their buffers concatenate in order
+    for (int t=0; t<pool.size(); t++)
+        local_base[t + 1] += local_base[t];
+    indices.resize(local_base.back());
+    offsets[n] = indices.size();
+
+    pool.parallel_for(n, [&](int begin, int end, int thread) {
+        for (int i=begin; i<end; i++)
+            offsets[i] += local_base[thread];
+        std::copy(local[thread].begin(), local[thread].end(), indices.begin() + local_base[thread]);
+    }, "List merge");
+
+    ref_x.assign(s.px.begin(), s.px.end());
+    ref_y.assign(s.py.begin(), s.py.end());
+    valid = true;
+}
+
+void NeighborList::invalidate()
+{
+    valid = false;
+}
+
+const int* NeighborList::begin(int i) const
+{
+    return indices.data() + offsets[i];
+}
+
+int NeighborList::count(int i) const
+{
+    return offsets[i + 1] - offsets[i];
+}
@@ -0,0 +1,53 @@
+#ifndef FLUIDSIM_NEIGHBORLIST_H
+#define FLUIDSIM_NEIGHBORLIST_H
+
+#include <vector>
+#include "ParticleStore.h"
+#include "GridContainer.h"
+#include "ThreadPool.h"
+
+/// Cached neighbor indices of every particle in compressed sparse row layout
+///
+/// Lists are built with a radius padded by a skin distance, so they stay a superset of the
+/// true neighbors until some particle has moved more than half the skin.
+class NeighborList
+{
+    // neighbors of particle i are indices[offsets[i]] up to indices[offsets[i+1]]
+    std::vector<int> offsets;
+    std::vector<int> indices;
+
+    // positions when the lists were built
+    AlignedVector<float> ref_x, ref_y;
+    // search radius the lists were built with, including the skin
+    float radius;
+    float skin;
+    // whether each pair is only listed by its lower index
+    bool half;
+    bool valid;
+
+    // per thread scratch for building
+    std::vector<std::vector<int>> local;
+    std::vector<std::vector<int>> candidates;
+    std::vector<int> local_base;
+    // largest squared displacement seen by each thread
+    std::vector<float> moved;
+
+public:
+    NeighborList() : radius(0.0), skin(0.0), half(false), valid(false) {}
+
+    /// Whether the lists can't be trusted for a search radius h with the current positions
+    bool stale(const ParticleStore& s, float h, float skin, bool half, ThreadPool& pool);
+
+    /// Rebuilds every list with radius h + skin from a grid binned with at least that radius
+    ///
+    /// Half lists only keep neighbors j > i so every pair is visited once
+    void build(const ParticleStore& s, const GridContainer& grid, float h, float skin, bool half, ThreadPool& pool);
+
+    /// Forces a rebuild, needed whenever particles are added, removed or reordered
+    void invalidate();
+
+    const int* begin(int i) const;
+    int count(int i) const;
+};
+
+#endif
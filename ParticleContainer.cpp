@@ -2,42 +2,26 @@
 
 #include <math.h>
 
-std::vector<Particle>& ParticleContainer::vec()
-{
-    return this->particles;
-}
-
 ParticleContainer::Iterator ParticleContainer::nearest(int i, float radius)
 {
-    return Iterator(*this, particles[i], radius);
-}
-
-void ParticleContainer::insert(Particle p)
-{
-    particles.push_back(p);
+    return Iterator(*this, i, radius);
 }
 
 ParticleContainer::Iterator& ParticleContainer::Iterator::operator++()
 {
-    while (i < (int)c.vec().size())
+    while (++i < c.store->size())
     {
-        ++i;
-        float dx = c.vec()[i].px - p.px;
-        float dy = c.vec()[i].py - p.py;
+        float dx = c.store->px[i] - x;
+        float dy = c.store->py[i] - y;
         if ((dx*dx+dy*dy)<(radius*radius))
             break;
     }
     return *this;
 }
 
-Particle& ParticleContainer::Iterator::operator*()
-{
-    return c.vec()[i];
-}
-
 bool ParticleContainer::Iterator::done()
 {
-    return i >= c.vec().size();
+    return i >= c.store->size();
 }
 
 int ParticleContainer::Iterator::idx()
@@ -45,13 +29,14 @@ int ParticleContainer::Iterator::idx()
     return i;
 }
 
-ParticleContainer::Iterator::Iterator(ParticleContainer& c, Particle& p, float r) : i(-1), c(c), p(p), radius(r) {
-    while (i < (int)c.vec().size())
+ParticleContainer::Iterator::Iterator(const ParticleContainer& c, int p, float r) : i(-1), c(c), radius(r) {
+    x = c.store->px[p];
+    y = c.store->py[p];
+    while (++i < c.store->size())
     {
-        ++i;
-        float dx = c.vec()[i].px - p.px;
-        float dy = c.vec()[i].py - p.py;
+        float dx = c.store->px[i] - x;
+        float dy = c.store->py[i] - y;
         if ((dx*dx+dy*dy)<(radius*radius))
             break;
     }
-}
\ No newline at end of file
+}
@@ -1,35 +1,102 @@
 #ifndef FLUIDSIM_PARTICLECONTAINER_H
 #define FLUIDSIM_PARTICLECONTAINER_H
 
+#include <algorithm>
 #include <vector>
-#include "Particle.h"
+#include "ParticleStore.h"
+
+// particles per block of the brute force container's for_each_neighbor_block
+constexpr int NEIGHBOR_BLOCK = 64;
 
 // A generic particle container
 class ParticleContainer
 {
     protected:
-    std::vector<Particle> particles;
+    // particles being indexed, set by update
+    const ParticleStore* store;
 
 public:
     class Iterator {
         int i;
         float radius;
-        ParticleContainer& c;
-        Particle& p;
-        Iterator(ParticleContainer& c, Particle& p, float r);
+        const ParticleContainer& c;
+        float x, y;
+        Iterator(const ParticleContainer& c, int p, float r);
     public:
-        virtual Iterator& operator++();
-        Particle& operator*();
+        Iterator& operator++();
         bool done();
         friend ParticleContainer;
         int idx();
     };
 
-    std::vector<Particle>& vec();
-    virtual void insert(Particle p);
-    virtual ParticleContainer::Iterator nearest(int i, float r);
-    virtual void update(float r) {}
+    ParticleContainer() : store(nullptr) {}
+
+    // not virtual since each container returns its own iterator type
+    ParticleContainer::Iterator nearest(int i, float r);
+
+    /// Indexes the particles in a store for searches of radius r
+    ///
+    /// Containers are used through their own types, never through this base, so nothing here is virtual
+    void update(const ParticleStore& s, float r) { store = &s; }
+
+    /// Calls f(j) for every particle j within r of particle i, i itself included
+    template <typename F>
+    void for_each_neighbor(int i, float r, F&& f) const;
+
+    /// Number of blocks for for_each_neighbor_block, here runs of NEIGHBOR_BLOCK consecutive particles
+    int block_count() const;
+
+    /// Calls f(i, j) for every particle i of a block and every particle j within r of it
+    ///
+    /// Each i sees its neighbors in the same order as for_each_neighbor, but a neighbor is
+    /// loaded once and tested against the whole block
+    template <typename F>
+    void for_each_neighbor_block(int block, float r, F&& f) const;
 };
 
+template <typename F>
+void ParticleContainer::for_each_neighbor(int i, float r, F&& f) const
+{
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    float x = px[i];
+    float y = py[i];
+    int n = store->size();
+    for (int j=0; j<n; j++)
+    {
+        float dx = px[j] - x;
+        float dy = py[j] - y;
+        if ((dx*dx+dy*dy)<(r*r))
+            f(j);
+    }
+}
+
+inline int ParticleContainer::block_count() const
+{
+    return (store->size() + NEIGHBOR_BLOCK - 1) / NEIGHBOR_BLOCK;
+}
+
+template <typename F>
+void ParticleContainer::for_each_neighbor_block(int block, float r, F&& f) const
+{
+    const float* px = store->px.data();
+    const float* py = store->py.data();
+    int n = store->size();
+    int begin = block * NEIGHBOR_BLOCK;
+    int end = std::min(n, begin + NEIGHBOR_BLOCK);
+    for (int j=0; j<n; j++)
+    {
+        float x = px[j];
+        float y = py[j];
+        for (int i=begin; i<end; i++)
+        {
+            float dx = x - px[i];
+            float dy = y - py[i];
+            if ((dx*dx+dy*dy)<(r*r))
+                f(i, j);
+        }
+    }
+}
+
 
 #endif
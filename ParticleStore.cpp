@@ -0,0 +1,103 @@
+#include "ParticleStore.h"
+
+int ParticleStore::size() const
+{
+    return px.size();
+}
+
+void ParticleStore::insert(const Particle& p)
+{
+    slots.push_back(ids.size());
+    ids.push_back(ids.size());
+
+    px.push_back(p.px);
+    py.push_back(p.py);
+    pz.push_back(p.pz);
+    vx.push_back(p.vx);
+    vy.push_back(p.vy);
+    density.push_back(0.0);
+    pressure.push_back(0.0);
+    fx.push_back(0.0);
+    fy.push_back(0.0);
+    next_px.push_back(p.px);
+    next_py.push_back(p.py);
+    next_vx.push_back(p.vx);
+    next_vy.push_back(p.vy);
+}
+
+void ParticleStore::clear()
+{
+    ids.clear();
+    slots.clear();
+
+    px.clear();
+    py.clear();
+    pz.clear();
+    vx.clear();
+    vy.clear();
+    density.clear();
+    pressure.clear();
+    fx.clear();
+    fy.clear();
+    next_px.clear();
+    next_py.clear();
+    next_vx.clear();
+    next_vy.clear();
+}
+
+void ParticleStore::swap_next()
+{
+    px.swap(next_px);
+    py.swap(next_py);
+    vx.swap(next_vx);
+    vy.swap(next_vy);
+}
+
+void ParticleStore::permute(AlignedVector<float>& field, const std::vector<int>& order, AlignedVector<float>& spare)
+{
+    spare.resize(field.size());
+    for (int k=0; k<order.size(); k++)
+        spare[k] = field[order[k]];
+    field.swap(spare);
+}
+
+void ParticleStore::reorder(const std::vector<int>& order)
+{
+    // the next buffers are only read after an update writes them, so they can hold the reordered fields
+    permute(px, order, next_px);
+    permute(py, order, next_py);
+    permute(pz, order, scratch);
+    permute(vx, order, next_vx);
+    permute(vy, order, next_vy);
+    permute(density, order, scratch);
+    permute(pressure, order, scratch);
+    permute(fx, order, scratch);
+    permute(fy, order, scratch);
+
+    // slots holds the new ids until the swap
+    for (int k=0; k<order.size(); k++)
+        slots[k] = ids[order[k]];
+    ids.swap(slots);
+    for (int k=0; k<ids.size(); k++)
+        slots[ids[k]] = k;
+}
+
+int ParticleStore::slot(int id) const
+{
+    // ids are handed out in insertion order and only cleared all at once
+    if (id < 0 || id >= static_cast<int>(slots.size()))
+        return -1;
+    return slots[id];
+}
+
+void ParticleStore::to_aos(std::vector<Particle>& out) const
+{
+    out.clear();
+    out.reserve(size());
+    for (int i=0; i<size(); i++)
+    {
+        out.emplace_back(px[i], py[i], pz[i]);
+        out.back().vx = vx[i];
+        out.back().vy = vy[i];
+    }
+}
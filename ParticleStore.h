@@ -0,0 +1,106 @@
+#ifndef FLUIDSIM_PARTICLESTORE_H
+#define FLUIDSIM_PARTICLESTORE_H
+
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+#include "Particle.h"
+
+// alignment of every particle array, one cache line
+constexpr std::size_t STORE_ALIGNMENT = 64;
+
+/// Allocator handing out cache line aligned storage
+template <typename T>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    AlignedAllocator() {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        void* p = nullptr;
+#ifdef _WIN32
+        p = _aligned_malloc(n * sizeof(T), STORE_ALIGNMENT);
+#else
+        if (posix_memalign(&p, STORE_ALIGNMENT, n * sizeof(T)) != 0)
+            p = nullptr;
+#endif
+        if (!p)
+            throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T* p, std::size_t)
+    {
+#ifdef _WIN32
+        _aligned_free(p);
+#else
+        free(p);
+#endif
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return true; }
+
+template <typename T, typename U>
+bool operator!=(const AlignedAllocator<T>&, const AlignedAllocator<U>&) { return false; }
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+/// All particle state as a structure of arrays
+///
+/// Each field is its own aligned array so a pass only streams the fields it reads
+class ParticleStore
+{
+    // stable id of the particle in each slot
+    std::vector<int> ids;
+    // slot of each id
+    std::vector<int> slots;
+    // spare storage for reordering
+    AlignedVector<float> scratch;
+
+    /// Applies a reorder to a single field, gathering into spare and swapping it in
+    void permute(AlignedVector<float>& field, const std::vector<int>& order, AlignedVector<float>& spare);
+
+public:
+    AlignedVector<float> px, py, pz;
+    AlignedVector<float> vx, vy;
+    AlignedVector<float> density;
+    AlignedVector<float> pressure;
+    // net force from the last physics update
+    AlignedVector<float> fx, fy;
+    // positions and velocities being written by an update while the current ones are still read
+    AlignedVector<float> next_px, next_py;
+    AlignedVector<float> next_vx, next_vy;
+
+    int size() const;
+
+    /// Makes the next positions and velocities current, the old ones become the next buffers
+    void swap_next();
+
+    /// Appends a particle, its id is its current slot
+    void insert(const Particle& p);
+
+    /// Removes all particles and their ids
+    void clear();
+
+    /// Permutes particles so slot k holds the particle previously in slot order[k]
+    void reorder(const std::vector<int>& order);
+
+    /// Current slot of the particle with a stable id, -1 if no particle has the id
+    int slot(int id) const;
+
+    /// Copies positions and velocities into an array of structs, only meant for uploading to OpenGL
+    void to_aos(std::vector<Particle>& out) const;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#include "RadixSort.h"
+#include <algorithm>
+
+void RadixSort::sort(std::vector<uint32_t>& keys, std::vector<int>& values, ThreadPool& pool, int bits)
+{
+    sort_keys(keys, scratch32, values, pool, bits);
+}
+
+void RadixSort::sort(std::vector<uint64_t>& keys, std::vector<int>& values, ThreadPool& pool, int bits)
+{
+    sort_keys(keys, scratch64, values, pool, bits);
+}
+
+template <typename Key>
+void RadixSort::sort_keys(std::vector<Key>& keys, std::vector<Key>& key_scratch, std::vector<int>& values,
+                          ThreadPool& pool, int bits)
+{
+    int n = keys.size();
+    if (n <= 1)
+        return;
+    key_scratch.resize(n);
+    value_scratch.resize(n);
+
+    // both phases of a pass must split the keys the same way, parallel_for always does for the same n
+    bool parallel = n >= RADIX_PARALLEL_MIN && pool.size() > 1;
+    int threads = parallel ? pool.size() : 1;
+    histograms.resize(threads);
+    auto for_ranges = [&](const ThreadPool::RangeFn& fn, const char* name) {
+        if (parallel)
+            pool.parallel_for(n, fn, name);
+        else
+            fn(0, n, 0);
+    };
+
+    bits = std::min<int>(bits, 8 * sizeof(Key));
+    for (int shift=0; shift<bits; shift+=RADIX_BITS)
+    {
+        const Key* src = keys.data();
+        const int* src_values = values.data();
+        Key* dst = key_scratch.data();
+        int* dst_values = value_scratch.data();
+
+        for_ranges([&](int begin, int end, int thread) {
+            int* count = histograms[thread].count;
+            std::fill(count, count + RADIX_BUCKETS, 0);
+            for (int i=begin; i<end; i++)
+                ++count[(src[i] >> shift) & (RADIX_BUCKETS - 1)];
+        }, "Radix count");
+
+        // turn the counts into where each thread writes each digit, threads in order so the sort is stable
+        int sum = 0;
+        bool shared = false;
+        for (int digit=0; digit<RADIX_BUCKETS; digit++)
+        {
+            int first = sum;
+            for (int t=0; t<threads; t++)
+            {
+                int count = histograms[t].count[digit];
+                histograms[t].count[digit] = sum;
+                sum += count;
+            }
+            shared |= sum - first == n;
+        }
+        if (shared)
+            continue;
+
+        for_ranges([&](int begin, int end, int thread) {
+            int* next = histograms[thread].count;
+            for (int i=begin; i<end; i++)
+            {
+                int k = next[(src[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                dst[k] = src[i];
+                dst_values[k] = src_values[i];
+            }
+        }, "Radix scatter");
+
+        // the scratch buffers now hold the result and the old keys become the next scratch
+        keys.swap(key_scratch);
+        values.swap(value_scratch);
+    }
+}
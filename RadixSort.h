@@ -0,0 +1,46 @@
+#ifndef FLUIDSIM_RADIXSORT_H
+#define FLUIDSIM_RADIXSORT_H
+
+#include <cstdint>
+#include <vector>
+#include "ThreadPool.h"
+
+// bits sorted per pass
+constexpr int RADIX_BITS = 8;
+constexpr int RADIX_BUCKETS = 1 << RADIX_BITS;
+
+// below this many keys a sort runs on the calling thread alone
+constexpr int RADIX_PARALLEL_MIN = 1 << 14;
+
+/// A parallel least significant digit radix sort of keys carrying an int payload
+///
+/// Every pass counts digits per thread and then each thread scatters its own range, so equal keys keep
+/// their order. Histograms and scratch buffers are kept between calls, so sorting the same number of
+/// keys every step doesn't allocate.
+class RadixSort
+{
+    /// Digit counts of one thread's range, padded so threads don't share cache lines
+    struct Histogram {
+        int count[RADIX_BUCKETS];
+        char pad[64];
+    };
+
+    std::vector<Histogram> histograms;
+    std::vector<uint32_t> scratch32;
+    std::vector<uint64_t> scratch64;
+    std::vector<int> value_scratch;
+
+    template <typename Key>
+    void sort_keys(std::vector<Key>& keys, std::vector<Key>& key_scratch, std::vector<int>& values, ThreadPool& pool,
+                   int bits);
+
+public:
+    /// Sorts keys ascending, moving values[i] along with keys[i]
+    ///
+    /// Only the low `bits` of each key are sorted by, and passes over a digit every key shares are skipped.
+    /// The vectors may trade storage with the scratch buffers, so pointers into them don't survive a call.
+    void sort(std::vector<uint32_t>& keys, std::vector<int>& values, ThreadPool& pool, int bits = 32);
+    void sort(std::vector<uint64_t>& keys, std::vector<int>& values, ThreadPool& pool, int bits = 64);
+};
+
+#endif
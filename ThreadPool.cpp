@@ -0,0 +1,189 @@
+#include "ThreadPool.h"
+#include "tracer.h"
+#include <chrono>
+
+ThreadPool::ThreadPool(int threads) : queues(threads), thread_stats(threads), job(nullptr), job_name(""), generation(0),
+    pending(0), stopping(false)
+{
+    reset_stats();
+    for (int t=1; t<threads; t++)
+        workers.emplace_back(&ThreadPool::worker, this, t);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start.notify_all();
+    for (auto& w : workers)
+        w.join();
+}
+
+int ThreadPool::size() const
+{
+    return workers.size() + 1;
+}
+
+const std::vector<ThreadPool::Stats>& ThreadPool::stats() const
+{
+    return thread_stats;
+}
+
+void ThreadPool::reset_stats()
+{
+    for (auto& s : thread_stats)
+        s = {0.0, 0, 0};
+}
+
+void ThreadPool::run_share(int thread)
+{
+    auto begin = std::chrono::steady_clock::now();
+    (*job)(thread);
+    auto end = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> busy = end - begin;
+    thread_stats[thread].busy += busy.count();
+    if (tracer().is_enabled())
+        tracer().record(job_name, begin, end);
+}
+
+void ThreadPool::run(const std::function<void(int thread)>& fn, const char* name)
+{
+    job = &fn;
+    job_name = name;
+    if (workers.empty())
+    {
+        run_share(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending = size();
+        ++generation;
+    }
+    start.notify_all();
+
+    run_share(0);
+
+    // wait for the workers so the next pass sees every write from this one
+    std::unique_lock<std::mutex> lock(mutex);
+    if (--pending == 0)
+    {
+        done.notify_all();
+        return;
+    }
+    TRACE_SCOPE("Barrier");
+    done.wait(lock, [this] { return pending == 0; });
+}
+
+void ThreadPool::finish_share(std::unique_lock<std::mutex>& lock, unsigned job_generation)
+{
+    if (--pending == 0)
+    {
+        done.notify_all();
+        return;
+    }
+
+    // the caller can post the next job as soon as everyone is done, so stop waiting then too
+    if (tracer().is_enabled())
+    {
+        TRACE_SCOPE("Barrier");
+        done.wait(lock, [&] { return pending == 0 || generation != job_generation; });
+    }
+}
+
+void ThreadPool::parallel_for(int n, const RangeFn& fn, const char* name)
+{
+    run([&](int thread) {
+        int begin = static_cast<long long>(n) * thread / size();
+        int end = static_cast<long long>(n) * (thread + 1) / size();
+        if (begin < end)
+            fn(begin, end, thread);
+    }, name);
+}
+
+void ThreadPool::run_tasks(int n, const TaskFn& fn, const char* name)
+{
+    for (int t=0; t<size(); t++)
+    {
+        queues[t].front = static_cast<long long>(n) * t / size();
+        queues[t].back = static_cast<long long>(n) * (t + 1) / size();
+    }
+
+    run([&](int thread) {
+        drain_tasks(thread, fn);
+    }, name);
+}
+
+void ThreadPool::drain_tasks(int thread, const TaskFn& fn)
+{
+    Stats& s = thread_stats[thread];
+    for (;;)
+    {
+        int task;
+        while (queues[thread].pop(task))
+        {
+            fn(task, thread);
+            ++s.tasks;
+        }
+
+        // out of work, look for a victim starting from the next thread
+        bool stolen = false;
+        for (int k=1; k<size() && !stolen; k++)
+            stolen = queues[(thread + k) % size()].steal_half(queues[thread]);
+        if (!stolen)
+            return;
+        ++s.steals;
+    }
+}
+
+bool ThreadPool::TaskQueue::pop(int& task)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (front >= back)
+        return false;
+    task = front++;
+    return true;
+}
+
+bool ThreadPool::TaskQueue::steal_half(TaskQueue& into)
+{
+    int first, last;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (front >= back)
+            return false;
+        // round up so a single remaining task can still be stolen
+        int count = (back - front + 1) / 2;
+        first = back - count;
+        last = back;
+        back = first;
+    }
+
+    std::lock_guard<std::mutex> lock(into.mutex);
+    into.front = first;
+    into.back = last;
+    return true;
+}
+
+void ThreadPool::worker(int thread)
+{
+    unsigned seen = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+
+        run_share(thread);
+
+        std::unique_lock<std::mutex> lock(mutex);
+        finish_share(lock, seen);
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef FLUIDSIM_THREADPOOL_H
+#define FLUIDSIM_THREADPOOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/// A fixed set of worker threads reused by every parallel pass
+///
+/// The calling thread takes part as thread 0, so a pool of one thread never starts a worker
+class ThreadPool
+{
+public:
+    /// Work on the range [begin, end) as thread number `thread`
+    typedef std::function<void(int begin, int end, int thread)> RangeFn;
+
+    /// Run one task as thread number `thread`
+    typedef std::function<void(int task, int thread)> TaskFn;
+
+    /// Work done by one thread since the last reset_stats
+    struct Stats {
+        // milliseconds spent running its share or taking tasks
+        double busy;
+        int tasks;
+        // successful steals from other threads
+        int steals;
+    };
+
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Number of threads including the caller
+    int size() const;
+
+    /// Splits [0, n) into one contiguous range per thread and returns once every range is done
+    ///
+    /// Each thread's share is traced under name, which has to outlive the trace
+    void parallel_for(int n, const RangeFn& fn, const char* name = "parallel_for");
+
+    /// Runs tasks [0, n) with work stealing and returns once every task is done
+    ///
+    /// Each thread starts with a contiguous block of tasks and works through it in order,
+    /// threads that run dry steal the back half of another thread's remaining block.
+    void run_tasks(int n, const TaskFn& fn, const char* name = "run_tasks");
+
+    const std::vector<Stats>& stats() const;
+    void reset_stats();
+
+private:
+    /// Remaining tasks [front, back) of one thread, padded so queues don't share cache lines
+    struct TaskQueue {
+        std::mutex mutex;
+        int front;
+        int back;
+        char pad[64];
+
+        TaskQueue() : front(0), back(0) {}
+        /// Takes the next task from the front
+        bool pop(int& task);
+        /// Moves the back half of this queue into another
+        bool steal_half(TaskQueue& into);
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<TaskQueue> queues;
+    std::vector<Stats> thread_stats;
+
+    std::mutex mutex;
+    // signals workers that a new job was posted or the pool is stopping
+    std::condition_variable start;
+    // signals the caller that the last worker finished
+    std::condition_variable done;
+
+    const std::function<void(int thread)>* job;
+    // label of the current job in traces
+    const char* job_name;
+    // incremented for every job so workers can tell a new one apart from a spurious wakeup
+    unsigned generation;
+    // threads still running the current job, the caller included
+    int pending;
+    bool stopping;
+
+    /// Runs a job on every thread and waits for all of them
+    void run(const std::function<void(int thread)>& fn, const char* name);
+
+    /// Runs this thread's part of the current job and records its busy time
+    void run_share(int thread);
+
+    /// Marks this thread's part of the current job done, while tracing it waits for the other threads so
+    /// the time spent in the barrier shows on its timeline
+    void finish_share(std::unique_lock<std::mutex>& lock, unsigned job_generation);
+
+    /// Takes tasks from this thread's queue, then from others, until none are left
+    void drain_tasks(int thread, const TaskFn& fn);
+
+    void worker(int thread);
+};
+
+#endif
@@ -0,0 +1,753 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "simulation.h"
+
+// Microbenchmarks of the containers, kernels and full physics updates
+//
+// Usage: fluidsim_bench [--benchmark_filter=<regex>] [--benchmark_min_time=<seconds>]
+//                       [--benchmark_out=<file>] [--benchmark_format=console|json] [--benchmark_list_tests]
+//
+// The flags and the JSON layout follow Google Benchmark, so its compare.py can diff runs across releases.
+// Every case is swept over the spawn patterns, particle counts and smoothing radii below, skipping
+// combinations that would visit more than PAIR_BUDGET particle pairs per iteration.
+
+namespace {
+
+const Simulation::Pattern PATTERNS[] = {Simulation::Pattern::Grid, Simulation::Pattern::Circle, Simulation::Pattern::Random};
+const char* const PATTERN_NAMES[] = {"Grid", "Circle", "Random"};
+const int COUNTS[] = {1000, 10000, 100000, 1000000};
+const float RADII[] = {0.01f, 0.02f, 0.05f, 0.15f};
+
+// rough area covered by a spawn pattern, for estimating neighbors per particle
+constexpr double SPAWN_AREA = 2.25;
+constexpr double PAIR_BUDGET = 2.5e8;
+// iterations are capped like Google Benchmark does
+constexpr long long MAX_ITERATIONS = 1000000000;
+
+/// CPU seconds used by the calling thread, so the CPU column leaves out the pool's workers like Google Benchmark
+double thread_cpu_seconds()
+{
+#ifdef _WIN32
+    // no per thread clock in the standard library, this is the whole process
+    return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#else
+    timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+#endif
+}
+
+/// Timing loop handed to every benchmark, time is only measured while keep_running is looping
+class State
+{
+    long long total;
+    long long remaining;
+    std::chrono::steady_clock::time_point wall_start;
+    double cpu_start;
+
+public:
+    double real_seconds;
+    double cpu_seconds;
+    double items;
+    std::map<std::string, double> counters;
+
+    explicit State(long long iterations)
+        : total(iterations), remaining(iterations), cpu_start(0.0), real_seconds(0.0), cpu_seconds(0.0), items(0.0) {}
+
+    bool keep_running()
+    {
+        if (remaining == total)
+        {
+            wall_start = std::chrono::steady_clock::now();
+            cpu_start = thread_cpu_seconds();
+        }
+        if (remaining-- > 0)
+            return true;
+
+        real_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+        cpu_seconds = thread_cpu_seconds() - cpu_start;
+        return false;
+    }
+
+    long long iterations() const { return total; }
+
+    /// Work done per iteration, reported as items_per_second
+    void set_items_per_iteration(double n) { items = n; }
+};
+
+struct Benchmark
+{
+    std::string name;
+    std::function<void(State&)> fn;
+};
+
+struct Result
+{
+    std::string name;
+    long long iterations;
+    State state;
+};
+
+/// Particles spawned by the simulation's own patterns, with neighbor lists for the kernels
+struct Scene
+{
+    Simulation sim;
+    std::unique_ptr<ThreadPool> pool;
+    GridContainer grid;
+    NeighborList full, half;
+    bool lists_built;
+
+    Scene() : lists_built(false) {}
+};
+
+/// Spawns a scene, keeping the last one since consecutive benchmarks mostly share it
+Scene& scene(Simulation::Pattern pattern, int count, float r)
+{
+    static std::unique_ptr<Scene> cached;
+    if (!cached || cached->sim.spawn_pattern != pattern || cached->sim.particle_count != count ||
+        cached->sim.smoothing_radius != r)
+    {
+        cached.reset(new Scene);
+        cached->sim.spawn_pattern = pattern;
+        cached->sim.particle_count = count;
+        cached->sim.smoothing_radius = r;
+        // the random pattern draws from rand, seed it so every run spawns the same particles
+        std::srand(1);
+        cached->sim.reset();
+    }
+    return *cached;
+}
+
+/// Builds full and half neighbor lists and fills in densities and pressures for the force kernels
+void prepare_kernels(Scene& s)
+{
+    if (s.lists_built)
+        return;
+
+    ParticleStore& particles = s.sim.get_particles();
+    float r = s.sim.smoothing_radius;
+    s.pool.reset(new ThreadPool(std::max(1u, std::thread::hardware_concurrency())));
+    s.grid.update(particles, r);
+    s.full.build(particles, s.grid, r, 0.0f, false, *s.pool);
+    s.half.build(particles, s.grid, r, 0.0f, true, *s.pool);
+
+    const KernelSet& kernels = scalar_kernels();
+    KernelArgs args = make_kernel_args(particles.px.data(), particles.py.data(), particles.vx.data(),
+                                       particles.vy.data(), particles.density.data(), particles.pressure.data(),
+                                       r, s.sim.mass, s.sim.viscosity);
+    for (int i=0; i<particles.size(); i++)
+    {
+        particles.density[i] = kernels.density(args, i, s.full.begin(i), s.full.count(i));
+        particles.pressure[i] = s.sim.gas_constant / 10000.0 * (s.sim.target_density - particles.density[i]);
+    }
+    s.lists_built = true;
+}
+
+KernelArgs scene_args(Scene& s)
+{
+    ParticleStore& p = s.sim.get_particles();
+    return make_kernel_args(p.px.data(), p.py.data(), p.vx.data(), p.vy.data(), p.density.data(), p.pressure.data(),
+                            s.sim.smoothing_radius, s.sim.mass, s.sim.viscosity);
+}
+
+/// Pairs visited by a radius search over every particle, roughly
+double estimated_pairs(int count, float r)
+{
+    double per_particle = std::min<double>(count, count * 3.1415926 * r * r / SPAWN_AREA);
+    return count * per_particle;
+}
+
+template <typename Container>
+void bench_update(State& state, Scene& s)
+{
+    Container c;
+    const ParticleStore& particles = s.sim.get_particles();
+    while (state.keep_running())
+        c.update(particles, s.sim.smoothing_radius);
+    state.set_items_per_iteration(particles.size());
+    state.counters["particles"] = particles.size();
+}
+
+template <typename Container>
+void bench_neighbors(State& state, Scene& s)
+{
+    Container c;
+    const ParticleStore& particles = s.sim.get_particles();
+    float r = s.sim.smoothing_radius;
+    c.update(particles, r);
+
+    long long pairs = 0;
+    while (state.keep_running())
+    {
+        pairs = 0;
+        for (int i=0; i<particles.size(); i++)
+        {
+            for (auto it = c.nearest(i, r); !it.done(); ++it)
+                pairs += it.idx() != i;
+        }
+    }
+    state.set_items_per_iteration(pairs);
+    state.counters["particles"] = particles.size();
+    state.counters["pairs"] = pairs;
+}
+
+/// Same search as bench_neighbors through the container's own traversal loop
+template <typename Container>
+void bench_for_each_neighbor(State& state, Scene& s)
+{
+    Container c;
+    const ParticleStore& particles = s.sim.get_particles();
+    float r = s.sim.smoothing_radius;
+    c.update(particles, r);
+
+    long long pairs = 0;
+    while (state.keep_running())
+    {
+        pairs = 0;
+        for (int i=0; i<particles.size(); i++)
+            c.for_each_neighbor(i, r, [&](int j) { pairs += j != i; });
+    }
+    state.set_items_per_iteration(pairs);
+    state.counters["particles"] = particles.size();
+    state.counters["pairs"] = pairs;
+}
+
+/// Same search again a block of particles at a time
+template <typename Container>
+void bench_neighbor_blocks(State& state, Scene& s)
+{
+    Container c;
+    const ParticleStore& particles = s.sim.get_particles();
+    float r = s.sim.smoothing_radius;
+    c.update(particles, r);
+
+    long long pairs = 0;
+    while (state.keep_running())
+    {
+        pairs = 0;
+        for (int b=0; b<c.block_count(); b++)
+            c.for_each_neighbor_block(b, r, [&](int i, int j) { pairs += j != i; });
+    }
+    state.set_items_per_iteration(pairs);
+    state.counters["particles"] = particles.size();
+    state.counters["pairs"] = pairs;
+    state.counters["blocks"] = c.block_count();
+}
+
+/// Bottom up quadtree build on every hardware thread, the serial build is BM_ContainerUpdate/BinaryPartition
+void bench_parallel_tree(State& state, Scene& s, int threads)
+{
+    BinaryPartitionContainer c;
+    ThreadPool pool(threads);
+    const ParticleStore& particles = s.sim.get_particles();
+    while (state.keep_running())
+        c.update(particles, s.sim.smoothing_radius, pool);
+    state.set_items_per_iteration(particles.size());
+    state.counters["particles"] = particles.size();
+    state.counters["threads"] = pool.size();
+}
+
+/// Registers one benchmark per container for every scene within the pair budget
+template <typename Container>
+void register_container(std::vector<Benchmark>& out, const char* container, bool brute_force)
+{
+    for (int p=0; p<3; p++)
+    {
+        for (int count : COUNTS)
+        {
+            for (float r : RADII)
+            {
+                char suffix[96];
+                std::snprintf(suffix, sizeof(suffix), "%s/pattern:%s/n:%d/r:%g", container, PATTERN_NAMES[p], count, r);
+                Simulation::Pattern pattern = PATTERNS[p];
+
+                out.push_back({std::string("BM_ContainerUpdate/") + suffix, [=](State& state) {
+                    bench_update<Container>(state, scene(pattern, count, r));
+                }});
+
+                double pairs = brute_force ? static_cast<double>(count) * count : estimated_pairs(count, r);
+                if (pairs > PAIR_BUDGET)
+                    continue;
+                out.push_back({std::string("BM_Neighbors/") + suffix, [=](State& state) {
+                    bench_neighbors<Container>(state, scene(pattern, count, r));
+                }});
+                out.push_back({std::string("BM_ForEachNeighbor/") + suffix, [=](State& state) {
+                    bench_for_each_neighbor<Container>(state, scene(pattern, count, r));
+                }});
+                out.push_back({std::string("BM_NeighborBlocks/") + suffix, [=](State& state) {
+                    bench_neighbor_blocks<Container>(state, scene(pattern, count, r));
+                }});
+            }
+        }
+    }
+}
+
+void register_parallel_tree(std::vector<Benchmark>& out)
+{
+    for (int p=0; p<3; p++)
+    {
+        for (int count : COUNTS)
+        {
+            for (float r : RADII)
+            {
+                char name[128];
+                std::snprintf(name, sizeof(name), "BM_ContainerUpdate/BinaryPartitionParallel/pattern:%s/n:%d/r:%g",
+                              PATTERN_NAMES[p], count, r);
+                Simulation::Pattern pattern = PATTERNS[p];
+                out.push_back({name, [=](State& state) {
+                    bench_parallel_tree(state, scene(pattern, count, r), std::max(1u, std::thread::hardware_concurrency()));
+                }});
+            }
+        }
+    }
+}
+
+void register_kernels(std::vector<Benchmark>& out)
+{
+    for (const KernelSet* set : available_kernels())
+    {
+        for (int p=0; p<3; p++)
+        {
+            for (int count : COUNTS)
+            {
+                for (float r : RADII)
+                {
+                    if (estimated_pairs(count, r) > PAIR_BUDGET)
+                        continue;
+
+                    char suffix[96];
+                    std::snprintf(suffix, sizeof(suffix), "%s/pattern:%s/n:%d/r:%g", set->name, PATTERN_NAMES[p], count, r);
+                    Simulation::Pattern pattern = PATTERNS[p];
+
+                    out.push_back({std::string("BM_DensityKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        int n = s.sim.get_particles().size();
+                        float sum = 0.0;
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                                sum += set->density(args, i, s.full.begin(i), s.full.count(i));
+                        }
+                        state.set_items_per_iteration(s.full.begin(n) - s.full.begin(0));
+                        state.counters["checksum"] = sum;
+                    }});
+
+                    out.push_back({std::string("BM_ForceKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        ParticleStore& particles = s.sim.get_particles();
+                        int n = particles.size();
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                                set->force(args, i, s.full.begin(i), s.full.count(i), particles.fx[i], particles.fy[i]);
+                        }
+                        state.set_items_per_iteration(s.full.begin(n) - s.full.begin(0));
+                    }});
+
+                    out.push_back({std::string("BM_DensityCacheKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        int n = s.sim.get_particles().size();
+                        int room = 0;
+                        for (int i=0; i<n; i++)
+                            room = std::max(room, s.full.count(i) + set->width);
+                        std::vector<int> j(room);
+                        AlignedVector<float> dx(room), dy(room);
+                        float sum = 0.0;
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                            {
+                                PairCache cache = {j.data(), dx.data(), dy.data(), 0};
+                                sum += set->density_cache(args, i, s.full.begin(i), s.full.count(i), cache);
+                            }
+                        }
+                        state.set_items_per_iteration(s.full.begin(n) - s.full.begin(0));
+                        state.counters["checksum"] = sum;
+                    }});
+
+                    out.push_back({std::string("BM_ForceCachedKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        ParticleStore& particles = s.sim.get_particles();
+                        int n = particles.size();
+
+                        // record every particle's pairs once up front, like the density pass does
+                        std::vector<int> j, begin(n), recorded(n);
+                        AlignedVector<float> dx, dy;
+                        int used = 0;
+                        for (int i=0; i<n; i++)
+                        {
+                            j.resize(used + s.full.count(i) + set->width);
+                            dx.resize(j.size());
+                            dy.resize(j.size());
+                            PairCache cache = {j.data() + used, dx.data() + used, dy.data() + used, 0};
+                            set->density_cache(args, i, s.full.begin(i), s.full.count(i), cache);
+                            begin[i] = used;
+                            recorded[i] = cache.count;
+                            used += (cache.count + set->width - 1) / set->width * set->width;
+                        }
+
+                        long long pairs = 0;
+                        for (int i=0; i<n; i++)
+                            pairs += recorded[i];
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                            {
+                                PairCache cache = {j.data() + begin[i], dx.data() + begin[i], dy.data() + begin[i], recorded[i]};
+                                set->force_cached(args, i, cache, particles.fx[i], particles.fy[i]);
+                            }
+                        }
+                        // pairs inside the radius, the other kernels count every candidate
+                        state.set_items_per_iteration(pairs);
+                    }});
+
+                    out.push_back({std::string("BM_DensityHalfKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        int n = s.sim.get_particles().size();
+                        AlignedVector<float> rho(n, 0.0f);
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                                set->density_half(args, i, s.half.begin(i), s.half.count(i), rho.data());
+                        }
+                        state.set_items_per_iteration(s.half.begin(n) - s.half.begin(0));
+                    }});
+
+                    out.push_back({std::string("BM_ForceHalfKernel/") + suffix, [=](State& state) {
+                        Scene& s = scene(pattern, count, r);
+                        prepare_kernels(s);
+                        KernelArgs args = scene_args(s);
+                        int n = s.sim.get_particles().size();
+                        AlignedVector<float> fx(n, 0.0f), fy(n, 0.0f);
+                        while (state.keep_running())
+                        {
+                            for (int i=0; i<n; i++)
+                                set->force_half(args, i, s.half.begin(i), s.half.count(i), fx.data(), fy.data());
+                        }
+                        state.set_items_per_iteration(s.half.begin(n) - s.half.begin(0));
+                    }});
+                }
+            }
+        }
+    }
+}
+
+/// Sorts random keys with an index payload, copying the unsorted input back in every iteration
+template <typename Key>
+void bench_sort(State& state, int count, bool radix)
+{
+    std::mt19937_64 random(1);
+    std::vector<Key> input(count);
+    for (Key& k : input)
+        k = static_cast<Key>(random());
+
+    std::vector<Key> keys;
+    std::vector<int> values;
+    std::vector<std::pair<Key, int>> pairs;
+    RadixSort sorter;
+    ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+    while (state.keep_running())
+    {
+        if (radix)
+        {
+            keys = input;
+            values.resize(count);
+            for (int i=0; i<count; i++)
+                values[i] = i;
+            sorter.sort(keys, values, pool);
+        }
+        else
+        {
+            pairs.resize(count);
+            for (int i=0; i<count; i++)
+                pairs[i] = {input[i], i};
+            std::sort(pairs.begin(), pairs.end());
+        }
+    }
+    state.set_items_per_iteration(count);
+    state.counters["threads"] = radix ? pool.size() : 1;
+}
+
+/// Serial against parallel quadtree builds over particle and thread counts, to place TREE_PARALLEL_MIN
+void register_tree_builds(std::vector<Benchmark>& out)
+{
+    const int counts[] = {1000, 4096, 16384, 32768, 65536, 262144, 1000000};
+    const float r = 0.02f;
+    int hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<int> thread_counts;
+    for (int threads=1; threads<hardware && threads<=8; threads*=2)
+        thread_counts.push_back(threads);
+    thread_counts.push_back(hardware);
+
+    for (int count : counts)
+    {
+        char name[96];
+        std::snprintf(name, sizeof(name), "BM_TreeBuild/Serial/n:%d", count);
+        out.push_back({name, [=](State& state) {
+            bench_update<BinaryPartitionContainer>(state, scene(Simulation::Pattern::Random, count, r));
+        }});
+        for (int threads : thread_counts)
+        {
+            std::snprintf(name, sizeof(name), "BM_TreeBuild/Parallel/threads:%d/n:%d", threads, count);
+            out.push_back({name, [=](State& state) {
+                bench_parallel_tree(state, scene(Simulation::Pattern::Random, count, r), threads);
+            }});
+        }
+    }
+}
+
+void register_sorts(std::vector<Benchmark>& out)
+{
+    for (int count : COUNTS)
+    {
+        for (int radix=0; radix<2; radix++)
+        {
+            const char* method = radix ? "Radix" : "Std";
+            char name[64];
+            std::snprintf(name, sizeof(name), "BM_Sort/%s/key:32/n:%d", method, count);
+            out.push_back({name, [=](State& state) { bench_sort<uint32_t>(state, count, radix); }});
+            std::snprintf(name, sizeof(name), "BM_Sort/%s/key:64/n:%d", method, count);
+            out.push_back({name, [=](State& state) { bench_sort<uint64_t>(state, count, radix); }});
+        }
+    }
+}
+
+void register_phys_update(std::vector<Benchmark>& out)
+{
+    for (int p=0; p<3; p++)
+    {
+        for (int count : COUNTS)
+        {
+            for (float r : RADII)
+            {
+                if (estimated_pairs(count, r) > PAIR_BUDGET)
+                    continue;
+
+                char name[96];
+                std::snprintf(name, sizeof(name), "BM_PhysUpdate/pattern:%s/n:%d/r:%g", PATTERN_NAMES[p], count, r);
+                Simulation::Pattern pattern = PATTERNS[p];
+
+                out.push_back({name, [=](State& state) {
+                    Simulation sim;
+                    sim.spawn_pattern = pattern;
+                    sim.particle_count = count;
+                    sim.smoothing_radius = r;
+                    std::srand(1);
+                    sim.reset();
+                    // the first update builds the pool and the grid
+                    sim.phys_update();
+                    while (state.keep_running())
+                        sim.phys_update();
+                    state.set_items_per_iteration(sim.get_particles().size());
+                    state.counters["threads"] = sim.threads;
+                }});
+            }
+        }
+    }
+}
+
+/// Runs a benchmark with more iterations until it takes at least min_time, the way Google Benchmark does
+Result run(const Benchmark& b, double min_time)
+{
+    long long iterations = 1;
+    for (;;)
+    {
+        State state(iterations);
+        b.fn(state);
+
+        double seconds = state.real_seconds;
+        if (seconds >= min_time || iterations >= MAX_ITERATIONS)
+            return {b.name, iterations, state};
+
+        // predict the iterations needed, growing at most 10x when the last run was too short to trust
+        double multiplier = seconds / min_time > 0.1 ? min_time * 1.4 / std::max(seconds, 1e-9) : 10.0;
+        iterations = std::min(MAX_ITERATIONS, std::max(iterations + 1, static_cast<long long>(iterations * multiplier)));
+    }
+}
+
+std::string json_escape(const std::string& s)
+{
+    std::string out;
+    for (char ch : s)
+    {
+        if (ch == '"' || ch == '\\')
+            out += '\\';
+        out += ch;
+    }
+    return out;
+}
+
+void write_json(std::ostream& out, const std::vector<Result>& results, const char* executable)
+{
+    char date[64];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", std::localtime(&now));
+
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"executable\": \"" << json_escape(executable) << "\",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"kernels\": \"" << select_kernels().name << "\",\n"
+#ifdef NDEBUG
+        << "    \"library_build_type\": \"release\"\n"
+#else
+        << "    \"library_build_type\": \"debug\"\n"
+#endif
+        << "  },\n  \"benchmarks\": [";
+
+    for (size_t k=0; k<results.size(); k++)
+    {
+        const Result& r = results[k];
+        double per_iteration = 1e9 / r.iterations;
+        out << (k ? ",\n" : "\n") << "    {\n"
+            << "      \"name\": \"" << json_escape(r.name) << "\",\n"
+            << "      \"family_index\": " << k << ",\n"
+            << "      \"per_family_instance_index\": 0,\n"
+            << "      \"run_name\": \"" << json_escape(r.name) << "\",\n"
+            << "      \"run_type\": \"iteration\",\n"
+            << "      \"repetitions\": 1,\n"
+            << "      \"repetition_index\": 0,\n"
+            << "      \"threads\": 1,\n"
+            << "      \"iterations\": " << r.iterations << ",\n"
+            << "      \"real_time\": " << r.state.real_seconds * per_iteration << ",\n"
+            << "      \"cpu_time\": " << r.state.cpu_seconds * per_iteration << ",\n"
+            << "      \"time_unit\": \"ns\"";
+        if (r.state.items > 0.0 && r.state.real_seconds > 0.0)
+            out << ",\n      \"items_per_second\": " << r.state.items * r.iterations / r.state.real_seconds;
+        for (const auto& counter : r.state.counters)
+            out << ",\n      \"" << json_escape(counter.first) << "\": " << counter.second;
+        out << "\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+void print_console(const Result& r)
+{
+    double per_iteration = 1e9 / r.iterations;
+    std::printf("%-72s %14.0f ns %14.0f ns %12lld", r.name.c_str(), r.state.real_seconds * per_iteration,
+                r.state.cpu_seconds * per_iteration, r.iterations);
+    if (r.state.items > 0.0 && r.state.real_seconds > 0.0)
+        std::printf(" %10.4g items/s", r.state.items * r.iterations / r.state.real_seconds);
+    std::printf("\n");
+    std::fflush(stdout);
+}
+
+/// Value of a --name=value flag, or null if arg is a different flag
+const char* flag_value(const char* arg, const char* name)
+{
+    size_t length = std::strlen(name);
+    if (std::strncmp(arg, name, length) != 0 || arg[length] != '=')
+        return nullptr;
+    return arg + length + 1;
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::string filter = ".";
+    double min_time = 0.5;
+    std::string out_path;
+    bool json = false;
+    bool list = false;
+
+    for (int a=1; a<argc; a++)
+    {
+        const char* value;
+        if ((value = flag_value(argv[a], "--benchmark_filter")))
+            filter = value;
+        else if ((value = flag_value(argv[a], "--benchmark_min_time")))
+            min_time = std::strtod(value, nullptr);
+        else if ((value = flag_value(argv[a], "--benchmark_out")))
+            out_path = value;
+        else if ((value = flag_value(argv[a], "--benchmark_format")))
+            json = std::strcmp(value, "json") == 0;
+        else if (std::strcmp(argv[a], "--benchmark_list_tests") == 0)
+            list = true;
+        else
+        {
+            std::cerr << "Unknown flag " << argv[a] << std::endl;
+            return 1;
+        }
+    }
+
+    std::vector<Benchmark> benchmarks;
+    register_container<ParticleContainer>(benchmarks, "BruteForce", true);
+    register_container<HashContainer>(benchmarks, "Hash", false);
+    register_container<BinaryPartitionContainer>(benchmarks, "BinaryPartition", false);
+    register_container<GridContainer>(benchmarks, "Grid", false);
+    register_parallel_tree(benchmarks);
+    register_tree_builds(benchmarks);
+    register_sorts(benchmarks);
+    register_kernels(benchmarks);
+    register_phys_update(benchmarks);
+
+    std::regex pattern;
+    try
+    {
+        pattern = std::regex(filter);
+    }
+    catch (const std::regex_error& e)
+    {
+        std::cerr << "Invalid --benchmark_filter: " << e.what() << std::endl;
+        return 1;
+    }
+
+    if (!json && !list)
+        std::printf("%-72s %17s %17s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+
+    std::vector<Result> results;
+    for (const Benchmark& b : benchmarks)
+    {
+        if (!std::regex_search(b.name, pattern))
+            continue;
+        if (list)
+        {
+            std::cout << b.name << "\n";
+            continue;
+        }
+
+        results.push_back(run(b, min_time));
+        if (!json)
+            print_console(results.back());
+    }
+
+    if (json)
+        write_json(std::cout, results, argv[0]);
+    if (!out_path.empty())
+    {
+        std::ofstream out(out_path);
+        if (!out)
+        {
+            std::cerr << "Could not write " << out_path << std::endl;
+            return 1;
+        }
+        write_json(out, results, argv[0]);
+    }
+    return 0;
+}
@@ -0,0 +1,287 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include "simulation.h"
+#include "profiler.h"
+
+// Runs a simulation without a window, as fast as the configured threads allow
+//
+// Usage: FluidSimHeadless <scenario> [key=value ...]
+//
+// The scenario is a text file of "key = value" lines, '#' starts a comment. Settings given on the
+// command line override the file. Every public Simulation parameter can be set by its field name,
+// spawn_pattern takes grid, circle or random and search takes grid, hash, binary_partition or
+// brute_force. The run itself is controlled by:
+//   steps              physics updates to perform (1000)
+//   duration           simulated seconds to run instead, used when above 0 (0)
+//   snapshot_interval  steps between particle snapshots, 0 for only the final state (0)
+//   output             path prefix of the snapshot, stats and timings files (fluidsim_)
+//   trace              file to write a Chrome trace of the run to, none by default
+//   perf_counters      read Linux hardware counters around each phase, needs FLUIDSIM_PROFILING (false)
+
+/// Settings of the run that aren't part of the simulation
+struct RunSettings
+{
+    int steps = 1000;
+    double duration = 0.0;
+    int snapshot_interval = 0;
+    std::string output = "fluidsim_";
+    std::string trace;
+    bool perf_counters = false;
+};
+
+static bool parse_bool(const std::string& value)
+{
+    return value == "1" || value == "true" || value == "on" || value == "yes";
+}
+
+/// Applies one setting, returns false if the key or value isn't recognised
+static bool apply_setting(Simulation& sim, RunSettings& run, const std::string& key, const std::string& value)
+{
+    float f = std::strtof(value.c_str(), nullptr);
+    int i = std::atoi(value.c_str());
+
+    if (key == "smoothing_radius") sim.smoothing_radius = f;
+    else if (key == "timestep") sim.timestep = f;
+    else if (key == "gravity") sim.gravity = f;
+    else if (key == "gas_constant") sim.gas_constant = f;
+    else if (key == "viscosity") sim.viscosity = f;
+    else if (key == "target_density") sim.target_density = f;
+    else if (key == "mass") sim.mass = f;
+    else if (key == "particle_count") sim.particle_count = i;
+    else if (key == "reorder_interval") sim.reorder_interval = i;
+    else if (key == "threads") sim.threads = i;
+    else if (key == "work_stealing") sim.work_stealing = parse_bool(value);
+    else if (key == "neighbor_lists") sim.neighbor_lists = parse_bool(value);
+    else if (key == "skin") sim.skin = f;
+    else if (key == "symmetric_forces") sim.symmetric_forces = parse_bool(value);
+    else if (key == "incremental_grid") sim.incremental_grid = parse_bool(value);
+    else if (key == "cache_pairs") sim.cache_pairs = parse_bool(value);
+    else if (key == "cell_blocks") sim.cell_blocks = parse_bool(value);
+    else if (key == "adaptive_timestep") sim.adaptive_timestep = parse_bool(value);
+    else if (key == "courant") sim.courant = f;
+    else if (key == "min_timestep") sim.min_timestep = f;
+    else if (key == "max_timestep") sim.max_timestep = f;
+    else if (key == "spawn_pattern")
+    {
+        if (value == "grid") sim.spawn_pattern = Simulation::Pattern::Grid;
+        else if (value == "circle") sim.spawn_pattern = Simulation::Pattern::Circle;
+        else if (value == "random") sim.spawn_pattern = Simulation::Pattern::Random;
+        else return false;
+    }
+    else if (key == "search")
+    {
+        if (value == "grid") sim.search = Simulation::Search::Grid;
+        else if (value == "hash") sim.search = Simulation::Search::Hash;
+        else if (value == "binary_partition") sim.search = Simulation::Search::BinaryPartition;
+        else if (value == "brute_force") sim.search = Simulation::Search::BruteForce;
+        else return false;
+    }
+    else if (key == "steps") run.steps = i;
+    else if (key == "duration") run.duration = f;
+    else if (key == "snapshot_interval") run.snapshot_interval = i;
+    else if (key == "output") run.output = value;
+    else if (key == "trace") run.trace = value;
+    else if (key == "perf_counters") run.perf_counters = parse_bool(value);
+    else return false;
+    return true;
+}
+
+/// Splits "key = value" and applies it, blank lines and comments are skipped
+static bool apply_line(Simulation& sim, RunSettings& run, std::string line)
+{
+    line = line.substr(0, line.find('#'));
+    size_t eq = line.find('=');
+    if (eq == std::string::npos)
+        return line.find_first_not_of(" \t\r") == std::string::npos;
+
+    auto trim = [](const std::string& s) {
+        size_t first = s.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            return std::string();
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    };
+    return apply_setting(sim, run, trim(line.substr(0, eq)), trim(line.substr(eq + 1)));
+}
+
+/// Writes every particle in id order so snapshots of a run line up row by row
+static bool write_snapshot(const Simulation& sim, const std::string& path)
+{
+    std::ofstream out(path);
+    if (!out)
+    {
+        std::cerr << "Could not write " << path << std::endl;
+        return false;
+    }
+
+    const ParticleStore& particles = sim.get_particles();
+    out << "id,px,py,vx,vy,density,pressure\n";
+    for (int id=0; id<particles.size(); id++)
+    {
+        int i = particles.slot(id);
+        out << id << ',' << particles.px[i] << ',' << particles.py[i] << ',' << particles.vx[i] << ','
+            << particles.vy[i] << ',' << particles.density[i] << ',' << particles.pressure[i] << '\n';
+    }
+    return true;
+}
+
+static std::string snapshot_path(const RunSettings& run, int step)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "snapshot_%06d.csv", step);
+    return run.output + name;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "Usage: " << argv[0] << " <scenario> [key=value ...]" << std::endl;
+        return 1;
+    }
+
+    Simulation sim;
+    RunSettings run;
+
+    std::ifstream scenario(argv[1]);
+    if (!scenario)
+    {
+        std::cerr << "Could not open scenario " << argv[1] << std::endl;
+        return 1;
+    }
+    std::string line;
+    for (int number=1; std::getline(scenario, line); number++)
+    {
+        if (!apply_line(sim, run, line))
+        {
+            std::cerr << argv[1] << ":" << number << ": unknown setting '" << line << "'" << std::endl;
+            return 1;
+        }
+    }
+    for (int a=2; a<argc; a++)
+    {
+        if (!apply_line(sim, run, argv[a]))
+        {
+            std::cerr << "Unknown setting '" << argv[a] << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    sim.reset();
+    tracer().set_enabled(!run.trace.empty());
+
+#ifndef FLUIDSIM_PROFILING
+    // counters are read by the phase scopes, which are compiled out
+    if (run.perf_counters)
+    {
+        std::cerr << "perf_counters needs a build with FLUIDSIM_PROFILING" << std::endl;
+        return 1;
+    }
+#endif
+
+    // opened before the first step creates the thread pool so the workers inherit them
+    if (run.perf_counters)
+    {
+        if (!perf_counters().open())
+            std::cerr << "Hardware counters unavailable: " << perf_counters().status() << std::endl;
+        else if (!perf_counters().status().empty())
+            std::cerr << "Some hardware counters unavailable: " << perf_counters().status() << std::endl;
+        perf_counters().set_sampling(true);
+    }
+
+    std::ofstream stats(run.output + "stats.csv");
+    if (!stats)
+    {
+        std::cerr << "Could not write " << run.output << "stats.csv" << std::endl;
+        return 1;
+    }
+    stats << "step,ms,dt\n";
+
+    double total_ms = 0.0;
+    double total_pairs = 0.0;
+    for (int step=1; run.duration > 0.0 ? sim.get_time() < run.duration : step <= run.steps; step++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        sim.phys_update();
+        total_pairs += sim.get_pair_count();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        total_ms += ms;
+        stats << step << ',' << ms << ',' << sim.get_step_timestep() << '\n';
+
+        if (run.snapshot_interval > 0 && step % run.snapshot_interval == 0 &&
+            !write_snapshot(sim, snapshot_path(run, step)))
+            return 1;
+    }
+    // a duration takes however many steps it needs
+    if (run.duration > 0.0)
+        run.steps = sim.get_steps();
+    if ((run.snapshot_interval <= 0 || run.steps % run.snapshot_interval != 0) &&
+        !write_snapshot(sim, snapshot_path(run, run.steps)))
+        return 1;
+
+    double seconds = total_ms / 1000.0;
+    std::cout << "particles:          " << sim.get_particles().size() << "\n"
+              << "threads:            " << sim.threads << "\n"
+              << "kernels:            " << select_kernels().name << "\n"
+              << "steps:              " << run.steps << "\n"
+              << "simulated seconds:  " << sim.get_time() << "\n"
+              << "neighbor builds:    " << sim.get_list_builds() << "\n"
+              << "seconds:            " << seconds << "\n"
+              << "steps per second:   " << (seconds > 0.0 ? run.steps / seconds : 0.0) << "\n"
+              << "ms per step:        " << (run.steps > 0 ? total_ms / run.steps : 0.0) << std::endl;
+
+#ifdef FLUIDSIM_PROFILING
+    // phases over the last PROFILE_HISTORY steps
+    for (int p=0; p<PHASE_COUNT; p++)
+    {
+        Profiler::Summary s = profiler().summary(static_cast<Phase>(p));
+        if (s.samples == 0)
+            continue;
+        std::printf("%-10s mean %.3f  p50 %.3f  p95 %.3f  max %.3f ms\n",
+                    phase_name(static_cast<Phase>(p)), s.mean, s.p50, s.p95, s.max);
+    }
+    // counters over the whole run, per particle per step and, for the phases running the kernels, per
+    // candidate pair within the radius or not
+    if (perf_counters().is_sampling())
+    {
+        double particle_steps = std::max(1.0, static_cast<double>(sim.get_particles().size()) * run.steps);
+        std::printf("candidate pairs:    %.0f per step\n", run.steps > 0 ? total_pairs / run.steps : 0.0);
+        for (int p=0; p<PHASE_COUNT; p++)
+        {
+            Phase phase = static_cast<Phase>(p);
+            if (profiler().counted(phase) == 0)
+                continue;
+            const double* v = profiler().total_counters(phase).values;
+            std::printf("%s", phase_name(phase));
+            if (perf_counters().available(Counter::Cycles) && perf_counters().available(Counter::Instructions) &&
+                v[static_cast<int>(Counter::Cycles)] > 0.0)
+                std::printf("  IPC %.2f", v[static_cast<int>(Counter::Instructions)] / v[static_cast<int>(Counter::Cycles)]);
+            std::printf("\n");
+            for (int k=0; k<COUNTER_COUNT; k++)
+            {
+                if (!perf_counters().available(static_cast<Counter>(k)))
+                    continue;
+                std::printf("    %-14s %12.2f /particle", counter_name(static_cast<Counter>(k)), v[k] / particle_steps);
+                if (phase_visits_pairs(phase))
+                    std::printf(" %10.3f /candidate", total_pairs > 0.0 ? v[k] / total_pairs : 0.0);
+                std::printf("\n");
+            }
+        }
+    }
+    if (!profiler().write_csv(run.output + "timings.csv"))
+    {
+        std::cerr << "Could not write " << run.output << "timings.csv" << std::endl;
+        return 1;
+    }
+#endif
+
+    if (!run.trace.empty() && !tracer().write_json(run.trace))
+    {
+        std::cerr << "Could not write " << run.trace << std::endl;
+        return 1;
+    }
+    return 0;
+}
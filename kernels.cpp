@@ -0,0 +1,210 @@
+#include "kernels.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+KernelArgs make_kernel_args(const float* px, const float* py, const float* vx, const float* vy,
+                            const float* density, const float* pressure,
+                            float smoothing_radius, float mass, float viscosity)
+{
+    KernelArgs a;
+    a.px = px;
+    a.py = py;
+    a.vx = vx;
+    a.vy = vy;
+    a.density = density;
+    a.pressure = pressure;
+    a.h_sq = smoothing_radius*smoothing_radius;
+    a.h_sq5 = a.h_sq*a.h_sq*a.h_sq*a.h_sq*a.h_sq;
+    a.mass = mass;
+    a.visc = viscosity / 1000000.0 * 0.5;
+    return a;
+}
+
+static float density_scalar(const KernelArgs& a, int i, const int* nbr, int n)
+{
+    float density = 0.0;
+    for (int k=0; k<n; k++)
+    {
+        int j = nbr[k];
+        float dx = a.px[j] - a.px[i], dy = a.py[j] - a.py[i];
+        float r_sq = dx*dx + dy*dy;
+        if (r_sq >= a.h_sq || (dx == 0.0 && dy == 0.0)) continue;
+
+        float diff_sq = a.h_sq - r_sq;
+        density += a.mass * (diff_sq*diff_sq*diff_sq / a.h_sq5);
+    }
+    return density;
+}
+
+static void force_scalar(const KernelArgs& a, int i, const int* nbr, int n, float& fx, float& fy)
+{
+    fx = 0.0;
+    fy = 0.0;
+    for (int k=0; k<n; k++)
+    {
+        int j = nbr[k];
+        float dx = a.px[j] - a.px[i], dy = a.py[j] - a.py[i];
+        float r_sq = dx*dx + dy*dy;
+        if (r_sq >= a.h_sq || (dx == 0.0 && dy == 0.0)) continue;
+        float diff_sq = a.h_sq - r_sq;
+
+        // pressure from the kernel gradient
+        float gradient = -6.0 * diff_sq*diff_sq / a.h_sq5;
+        float componentless = 0.0;
+        if (a.density[j] != 0.0)
+            componentless = (a.pressure[i] + a.pressure[j]) * a.mass * -0.5 / a.density[j];
+        fx += componentless * (gradient * dx);
+        fy += componentless * (gradient * dy);
+
+        // viscosity from the kernel laplacian
+        float laplacian = 6.0 * diff_sq / a.h_sq5;
+        componentless = a.visc * (laplacian * (6.0*r_sq - 2.0*a.h_sq));
+        fx += (a.vx[j] - a.vx[i]) * componentless;
+        fy += (a.vy[j] - a.vy[i]) * componentless;
+    }
+}
+
+static void density_half_scalar(const KernelArgs& a, int i, const int* nbr, int n, float* rho)
+{
+    for (int k=0; k<n; k++)
+    {
+        int j = nbr[k];
+        float dx = a.px[j] - a.px[i], dy = a.py[j] - a.py[i];
+        float r_sq = dx*dx + dy*dy;
+        if (r_sq >= a.h_sq || (dx == 0.0 && dy == 0.0)) continue;
+
+        float diff_sq = a.h_sq - r_sq;
+        float w = a.mass * (diff_sq*diff_sq*diff_sq / a.h_sq5);
+        rho[i] += w;
+        rho[j] += w;
+    }
+}
+
+static void force_half_scalar(const KernelArgs& a, int i, const int* nbr, int n, float* fx, float* fy)
+{
+    for (int k=0; k<n; k++)
+    {
+        int j = nbr[k];
+        float dx = a.px[j] - a.px[i], dy = a.py[j] - a.py[i];
+        float r_sq = dx*dx + dy*dy;
+        if (r_sq >= a.h_sq || (dx == 0.0 && dy == 0.0)) continue;
+        float diff_sq = a.h_sq - r_sq;
+
+        // j sees the offset reversed, so its terms are subtracted
+        float gradient = -6.0 * diff_sq*diff_sq / a.h_sq5;
+        float shared = (a.pressure[i] + a.pressure[j]) * a.mass * -0.5;
+        float on_i = a.density[j] != 0.0 ? shared / a.density[j] : 0.0;
+        float on_j = a.density[i] != 0.0 ? shared / a.density[i] : 0.0;
+
+        float laplacian = 6.0 * diff_sq / a.h_sq5;
+        float viscous = a.visc * (laplacian * (6.0*r_sq - 2.0*a.h_sq));
+        float dvx = a.vx[j] - a.vx[i], dvy = a.vy[j] - a.vy[i];
+
+        fx[i] += on_i * (gradient * dx) + dvx * viscous;
+        fy[i] += on_i * (gradient * dy) + dvy * viscous;
+        fx[j] -= on_j * (gradient * dx) + dvx * viscous;
+        fy[j] -= on_j * (gradient * dy) + dvy * viscous;
+    }
+}
+
+static float density_cache_scalar(const KernelArgs& a, int i, const int* nbr, int n, PairCache& cache)
+{
+    float density = 0.0;
+    cache.count = 0;
+    for (int k=0; k<n; k++)
+    {
+        int j = nbr[k];
+        float dx = a.px[j] - a.px[i], dy = a.py[j] - a.py[i];
+        float r_sq = dx*dx + dy*dy;
+        if (r_sq >= a.h_sq || (dx == 0.0 && dy == 0.0)) continue;
+
+        float diff_sq = a.h_sq - r_sq;
+        density += a.mass * (diff_sq*diff_sq*diff_sq / a.h_sq5);
+        cache.j[cache.count] = j;
+        cache.dx[cache.count] = dx;
+        cache.dy[cache.count] = dy;
+        ++cache.count;
+    }
+    return density;
+}
+
+static void force_cached_scalar(const KernelArgs& a, int i, const PairCache& cache, float& fx, float& fy)
+{
+    fx = 0.0;
+    fy = 0.0;
+    for (int k=0; k<cache.count; k++)
+    {
+        int j = cache.j[k];
+        float dx = cache.dx[k], dy = cache.dy[k];
+        float r_sq = dx*dx + dy*dy;
+        float diff_sq = a.h_sq - r_sq;
+
+        // pressure from the kernel gradient
+        float gradient = -6.0 * diff_sq*diff_sq / a.h_sq5;
+        float componentless = 0.0;
+        if (a.density[j] != 0.0)
+            componentless = (a.pressure[i] + a.pressure[j]) * a.mass * -0.5 / a.density[j];
+        fx += componentless * (gradient * dx);
+        fy += componentless * (gradient * dy);
+
+        // viscosity from the kernel laplacian
+        float laplacian = 6.0 * diff_sq / a.h_sq5;
+        componentless = a.visc * (laplacian * (6.0*r_sq - 2.0*a.h_sq));
+        fx += (a.vx[j] - a.vx[i]) * componentless;
+        fy += (a.vy[j] - a.vy[i]) * componentless;
+    }
+}
+
+const KernelSet& scalar_kernels()
+{
+    static const KernelSet set = {"scalar", 1, density_scalar, force_scalar, density_half_scalar, force_half_scalar,
+                                  density_cache_scalar, force_cached_scalar};
+    return set;
+}
+
+/// Picks the widest kernels the CPU and OS support
+static const KernelSet& detect_kernels()
+{
+    const char* forced = std::getenv("FLUIDSIM_KERNELS");
+    if (forced && std::strcmp(forced, "scalar") == 0)
+        return scalar_kernels();
+
+#if defined(FLUIDSIM_X86_KERNELS) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    bool has_avx512 = __builtin_cpu_supports("avx512f");
+    bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+    if (forced && std::strcmp(forced, "avx512") == 0 && !has_avx512)
+        std::cerr << "FLUIDSIM_KERNELS=avx512 is not supported by this CPU" << std::endl;
+    else if (forced && std::strcmp(forced, "avx2") == 0 && has_avx2)
+        return avx2_kernels();
+    else if (forced && std::strcmp(forced, "avx2") == 0)
+        std::cerr << "FLUIDSIM_KERNELS=avx2 is not supported by this CPU" << std::endl;
+
+    if (has_avx512)
+        return avx512_kernels();
+    if (has_avx2)
+        return avx2_kernels();
+#endif
+    return scalar_kernels();
+}
+
+std::vector<const KernelSet*> available_kernels()
+{
+    std::vector<const KernelSet*> sets(1, &scalar_kernels());
+#if defined(FLUIDSIM_X86_KERNELS) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        sets.push_back(&avx2_kernels());
+    if (__builtin_cpu_supports("avx512f"))
+        sets.push_back(&avx512_kernels());
+#endif
+    return sets;
+}
+
+const KernelSet& select_kernels()
+{
+    static const KernelSet& set = detect_kernels();
+    return set;
+}
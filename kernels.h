@@ -0,0 +1,97 @@
+#ifndef FLUIDSIM_KERNELS_H
+#define FLUIDSIM_KERNELS_H
+
+#include <vector>
+
+/// Everything the batched kernels read for one pass
+struct KernelArgs
+{
+    const float* px;
+    const float* py;
+    const float* vx;
+    const float* vy;
+    const float* density;
+    const float* pressure;
+    // smoothing radius squared and its fifth power (h^10)
+    float h_sq;
+    float h_sq5;
+    float mass;
+    // viscosity with its scaling already applied
+    float visc;
+};
+
+/// Neighbors of one particle within the smoothing radius and their offsets, recorded by the density pass
+///
+/// The recorded pairs are padded to a multiple of the kernel width with i itself at zero offset, which
+/// every kernel masks out, so the force kernel never needs a partial batch
+struct PairCache
+{
+    int* j;
+    float* dx;
+    float* dy;
+    // pairs recorded, not counting the padding
+    int count;
+};
+
+/// Builds the kernel arguments for the current simulation parameters
+KernelArgs make_kernel_args(const float* px, const float* py, const float* vx, const float* vy,
+                            const float* density, const float* pressure,
+                            float smoothing_radius, float mass, float viscosity);
+
+/// Sums the mass weighted density kernel of every candidate within the smoothing radius of particle i
+typedef float (*DensityKernel)(const KernelArgs& a, int i, const int* nbr, int n);
+
+/// Sums the pressure and viscosity force on particle i from every candidate within the smoothing radius
+typedef void (*ForceKernel)(const KernelArgs& a, int i, const int* nbr, int n, float& fx, float& fy);
+
+/// Adds the density kernel of each candidate pair to both rho[i] and rho[j]
+///
+/// Used with half neighbor lists where every pair appears once
+typedef void (*DensityHalfKernel)(const KernelArgs& a, int i, const int* nbr, int n, float* rho);
+
+/// Adds the force of each candidate pair to both particle i and particle j
+///
+/// Only the viscosity terms are equal and opposite. The pressure terms are divided by the other particle's
+/// density on each side, matching the full list kernels, so a pair's pressure forces differ whenever the two
+/// densities do and momentum is not exactly conserved.
+typedef void (*ForceHalfKernel)(const KernelArgs& a, int i, const int* nbr, int n, float* fx, float* fy);
+
+/// Like DensityKernel, also recording every neighbor within the radius into the cache
+///
+/// The cache needs room for n + width pairs
+typedef float (*DensityCacheKernel)(const KernelArgs& a, int i, const int* nbr, int n, PairCache& cache);
+
+/// Like ForceKernel over the pairs a DensityCacheKernel recorded, without gathering positions again
+typedef void (*ForceCachedKernel)(const KernelArgs& a, int i, const PairCache& cache, float& fx, float& fy);
+
+/// One implementation of the batched kernels
+///
+/// Candidates may include particles outside the smoothing radius and i itself, both are masked out
+struct KernelSet
+{
+    const char* name;
+    // particle pairs evaluated per instruction
+    int width;
+    DensityKernel density;
+    ForceKernel force;
+    DensityHalfKernel density_half;
+    ForceHalfKernel force_half;
+    DensityCacheKernel density_cache;
+    ForceCachedKernel force_cached;
+};
+
+/// Fastest kernels this CPU supports, detected once on first use
+///
+/// Setting FLUIDSIM_KERNELS to scalar, avx2 or avx512 forces a specific set
+const KernelSet& select_kernels();
+
+/// Every kernel set this CPU supports, narrowest first
+std::vector<const KernelSet*> available_kernels();
+
+const KernelSet& scalar_kernels();
+#ifdef FLUIDSIM_X86_KERNELS
+const KernelSet& avx2_kernels();
+const KernelSet& avx512_kernels();
+#endif
+
+#endif
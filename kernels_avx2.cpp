@@ -0,0 +1,87 @@
+// Compiled with AVX2 and FMA enabled, only called after select_kernels checks the CPU
+#include <immintrin.h>
+#include "kernels.h"
+
+namespace {
+
+/// Lane permutation packing the lanes of each 8 bit mask to the front, built on first use
+///
+/// Not built at startup since this file may only run its code after the CPU check
+const __m256i* compress_permutations()
+{
+    struct Table {
+        alignas(32) int lanes[256][8];
+        Table()
+        {
+            for (int bits=0; bits<256; bits++)
+            {
+                int packed = 0;
+                for (int t=0; t<8; t++)
+                {
+                    if (bits & (1 << t))
+                        lanes[bits][packed++] = t;
+                }
+                while (packed < 8)
+                    lanes[bits][packed++] = 0;
+            }
+        }
+    };
+    static const Table table;
+    return reinterpret_cast<const __m256i*>(table.lanes);
+}
+
+/// Eight float lanes in AVX2 registers
+struct VecAVX2
+{
+    static constexpr int width = 8;
+    typedef __m256 F;
+    typedef __m256i I;
+    typedef __m256 M;
+
+    static F set1(float x) { return _mm256_set1_ps(x); }
+    static F zero() { return _mm256_setzero_ps(); }
+    static I load_idx(const int* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+    static F load(const float* p) { return _mm256_loadu_ps(p); }
+    static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+    static void store_idx(int* p, I a) { _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), a); }
+    static F gather(const float* base, I idx) { return _mm256_i32gather_ps(base, idx, 4); }
+
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F fmadd(F a, F b, F c) { return _mm256_fmadd_ps(a, b, c); }
+    static F fmsub(F a, F b, F c) { return _mm256_fmsub_ps(a, b, c); }
+
+    static M lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static M neq(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static M and_(M a, M b) { return _mm256_and_ps(a, b); }
+    static M or_(M a, M b) { return _mm256_or_ps(a, b); }
+    /// lanes selected by a mask moved to the front in order, unspecified after them
+    static F compress(M m, F a) { return _mm256_permutevar8x32_ps(a, compress_permutations()[bits(m)]); }
+    static I compress_idx(M m, I a) { return _mm256_permutevar8x32_epi32(a, compress_permutations()[bits(m)]); }
+    /// one bit per lane of a mask
+    static unsigned bits(M m) { return _mm256_movemask_ps(m); }
+    /// a where the mask is set, zero elsewhere
+    static F select(M m, F a) { return _mm256_and_ps(m, a); }
+
+    static float reduce(F a)
+    {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        return _mm_cvtss_f32(sum);
+    }
+};
+
+}
+
+#include "kernels_impl.h"
+
+const KernelSet& avx2_kernels()
+{
+    static const KernelSet set = {"avx2", VecAVX2::width, density_batch<VecAVX2>, force_batch<VecAVX2>,
+                                   density_half_batch<VecAVX2>, force_half_batch<VecAVX2>,
+                                   density_cache_batch<VecAVX2>, force_cached_batch<VecAVX2>};
+    return set;
+}
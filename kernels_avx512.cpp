@@ -0,0 +1,55 @@
+// Compiled with AVX-512F enabled, only called after select_kernels checks the CPU
+#include <immintrin.h>
+#include "kernels.h"
+
+namespace {
+
+/// Sixteen float lanes in AVX-512 registers with mask registers for comparisons
+struct VecAVX512
+{
+    static constexpr int width = 16;
+    typedef __m512 F;
+    typedef __m512i I;
+    typedef __mmask16 M;
+
+    static F set1(float x) { return _mm512_set1_ps(x); }
+    static F zero() { return _mm512_setzero_ps(); }
+    static I load_idx(const int* p) { return _mm512_loadu_si512(p); }
+    static F load(const float* p) { return _mm512_loadu_ps(p); }
+    static void store(float* p, F a) { _mm512_storeu_ps(p, a); }
+    static void store_idx(int* p, I a) { _mm512_storeu_si512(p, a); }
+    static F gather(const float* base, I idx) { return _mm512_i32gather_ps(idx, base, 4); }
+
+    static F add(F a, F b) { return _mm512_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+    static F div(F a, F b) { return _mm512_div_ps(a, b); }
+    static F fmadd(F a, F b, F c) { return _mm512_fmadd_ps(a, b, c); }
+    static F fmsub(F a, F b, F c) { return _mm512_fmsub_ps(a, b, c); }
+
+    static M lt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+    static M neq(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_NEQ_UQ); }
+    static M and_(M a, M b) { return a & b; }
+    static M or_(M a, M b) { return a | b; }
+    /// lanes selected by a mask moved to the front in order, zero after them
+    static F compress(M m, F a) { return _mm512_maskz_compress_ps(m, a); }
+    static I compress_idx(M m, I a) { return _mm512_maskz_compress_epi32(m, a); }
+    /// one bit per lane of a mask
+    static unsigned bits(M m) { return m; }
+    /// a where the mask is set, zero elsewhere
+    static F select(M m, F a) { return _mm512_maskz_mov_ps(m, a); }
+
+    static float reduce(F a) { return _mm512_reduce_add_ps(a); }
+};
+
+}
+
+#include "kernels_impl.h"
+
+const KernelSet& avx512_kernels()
+{
+    static const KernelSet set = {"avx512", VecAVX512::width, density_batch<VecAVX512>, force_batch<VecAVX512>,
+                                   density_half_batch<VecAVX512>, force_half_batch<VecAVX512>,
+                                   density_cache_batch<VecAVX512>, force_cached_batch<VecAVX512>};
+    return set;
+}
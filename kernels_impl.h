@@ -0,0 +1,292 @@
+#ifndef FLUIDSIM_KERNELS_IMPL_H
+#define FLUIDSIM_KERNELS_IMPL_H
+
+// Batched kernel bodies shared by every SIMD kernel set
+//
+// Only include this from a kernels_*.cpp file compiled for its instruction set, after defining a
+// vector type V with the operations used below. Everything here has internal linkage so copies
+// built for different instruction sets never get merged by the linker.
+
+#include "kernels.h"
+
+namespace {
+
+/// Loads the next V::width candidates, padding past the end with i which is always masked out
+template <typename V>
+typename V::I load_candidates(const int* nbr, int k, int n, int i)
+{
+    if (k + V::width <= n)
+        return V::load_idx(nbr + k);
+
+    alignas(64) int tail[V::width];
+    for (int t=0; t<V::width; t++)
+        tail[t] = k + t < n ? nbr[k + t] : i;
+    return V::load_idx(tail);
+}
+
+template <typename V>
+float density_batch(const KernelArgs& a, int i, const int* nbr, int n)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F xi = V::set1(a.px[i]), yi = V::set1(a.py[i]);
+    F h_sq = V::set1(a.h_sq);
+    F zero = V::zero();
+    F sum = zero;
+
+    for (int k=0; k<n; k+=V::width)
+    {
+        typename V::I idx = load_candidates<V>(nbr, k, n, i);
+        F dx = V::sub(V::gather(a.px, idx), xi);
+        F dy = V::sub(V::gather(a.py, idx), yi);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+
+        // inside the radius and not coincident with particle i
+        M m = V::and_(V::lt(r_sq, h_sq), V::or_(V::neq(dx, zero), V::neq(dy, zero)));
+
+        F diff_sq = V::sub(h_sq, r_sq);
+        F w = V::mul(V::mul(diff_sq, diff_sq), diff_sq);
+        sum = V::add(sum, V::select(m, w));
+    }
+
+    return V::reduce(sum) * (a.mass / a.h_sq5);
+}
+
+template <typename V>
+void force_batch(const KernelArgs& a, int i, const int* nbr, int n, float& fx, float& fy)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F xi = V::set1(a.px[i]), yi = V::set1(a.py[i]);
+    F vxi = V::set1(a.vx[i]), vyi = V::set1(a.vy[i]);
+    F pi = V::set1(a.pressure[i]);
+    F h_sq = V::set1(a.h_sq);
+    F two_h_sq = V::set1(2.0f * a.h_sq);
+    F zero = V::zero();
+    F six = V::set1(6.0f);
+    F gradient_scale = V::set1(-6.0f / a.h_sq5);
+    F laplacian_scale = V::set1(6.0f / a.h_sq5 * a.visc);
+    F pressure_scale = V::set1(a.mass * -0.5f);
+    F sum_x = zero, sum_y = zero;
+
+    for (int k=0; k<n; k+=V::width)
+    {
+        typename V::I idx = load_candidates<V>(nbr, k, n, i);
+        F dx = V::sub(V::gather(a.px, idx), xi);
+        F dy = V::sub(V::gather(a.py, idx), yi);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+        M m = V::and_(V::lt(r_sq, h_sq), V::or_(V::neq(dx, zero), V::neq(dy, zero)));
+        F diff_sq = V::sub(h_sq, r_sq);
+
+        // pressure from the kernel gradient, skipping neighbors with no density
+        F density = V::gather(a.density, idx);
+        F pj = V::gather(a.pressure, idx);
+        F componentless = V::div(V::mul(V::add(pi, pj), pressure_scale), density);
+        componentless = V::select(V::neq(density, zero), componentless);
+        F gradient = V::mul(V::mul(diff_sq, diff_sq), gradient_scale);
+        F pressure = V::mul(componentless, gradient);
+
+        // viscosity from the kernel laplacian
+        F viscous = V::mul(V::mul(diff_sq, laplacian_scale), V::fmsub(six, r_sq, two_h_sq));
+        F dvx = V::sub(V::gather(a.vx, idx), vxi);
+        F dvy = V::sub(V::gather(a.vy, idx), vyi);
+
+        sum_x = V::add(sum_x, V::select(m, V::fmadd(pressure, dx, V::mul(dvx, viscous))));
+        sum_y = V::add(sum_y, V::select(m, V::fmadd(pressure, dy, V::mul(dvy, viscous))));
+    }
+
+    fx = V::reduce(sum_x);
+    fy = V::reduce(sum_y);
+}
+
+template <typename V>
+float density_cache_batch(const KernelArgs& a, int i, const int* nbr, int n, PairCache& cache)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F xi = V::set1(a.px[i]), yi = V::set1(a.py[i]);
+    F h_sq = V::set1(a.h_sq);
+    F zero = V::zero();
+    F sum = zero;
+    cache.count = 0;
+
+    for (int k=0; k<n; k+=V::width)
+    {
+        typename V::I idx = load_candidates<V>(nbr, k, n, i);
+        F dx = V::sub(V::gather(a.px, idx), xi);
+        F dy = V::sub(V::gather(a.py, idx), yi);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+        M m = V::and_(V::lt(r_sq, h_sq), V::or_(V::neq(dx, zero), V::neq(dy, zero)));
+
+        F diff_sq = V::sub(h_sq, r_sq);
+        F w = V::mul(V::mul(diff_sq, diff_sq), diff_sq);
+        sum = V::add(sum, V::select(m, w));
+
+        // pack the lanes inside the radius to the front and store whole vectors, the n + width pairs of
+        // room cover the lanes past the packed ones that get overwritten by the next batch
+        V::store_idx(cache.j + cache.count, V::compress_idx(m, idx));
+        V::store(cache.dx + cache.count, V::compress(m, dx));
+        V::store(cache.dy + cache.count, V::compress(m, dy));
+        cache.count += __builtin_popcount(V::bits(m));
+    }
+
+    // fill the last batch with i at zero offset, which the force kernel masks out
+    for (int c = cache.count; c % V::width != 0; c++)
+    {
+        cache.j[c] = i;
+        cache.dx[c] = 0.0f;
+        cache.dy[c] = 0.0f;
+    }
+
+    return V::reduce(sum) * (a.mass / a.h_sq5);
+}
+
+template <typename V>
+void force_cached_batch(const KernelArgs& a, int i, const PairCache& cache, float& fx, float& fy)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F vxi = V::set1(a.vx[i]), vyi = V::set1(a.vy[i]);
+    F pi = V::set1(a.pressure[i]);
+    F h_sq = V::set1(a.h_sq);
+    F two_h_sq = V::set1(2.0f * a.h_sq);
+    F zero = V::zero();
+    F six = V::set1(6.0f);
+    F gradient_scale = V::set1(-6.0f / a.h_sq5);
+    F laplacian_scale = V::set1(6.0f / a.h_sq5 * a.visc);
+    F pressure_scale = V::set1(a.mass * -0.5f);
+    F sum_x = zero, sum_y = zero;
+
+    for (int k=0; k<cache.count; k+=V::width)
+    {
+        typename V::I idx = V::load_idx(cache.j + k);
+        F dx = V::load(cache.dx + k);
+        F dy = V::load(cache.dy + k);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+        // every recorded pair is inside the radius, only the padding needs masking
+        M m = V::or_(V::neq(dx, zero), V::neq(dy, zero));
+        F diff_sq = V::sub(h_sq, r_sq);
+
+        F density = V::gather(a.density, idx);
+        F pj = V::gather(a.pressure, idx);
+        F componentless = V::div(V::mul(V::add(pi, pj), pressure_scale), density);
+        componentless = V::select(V::neq(density, zero), componentless);
+        F gradient = V::mul(V::mul(diff_sq, diff_sq), gradient_scale);
+        F pressure = V::mul(componentless, gradient);
+
+        F viscous = V::mul(V::mul(diff_sq, laplacian_scale), V::fmsub(six, r_sq, two_h_sq));
+        F dvx = V::sub(V::gather(a.vx, idx), vxi);
+        F dvy = V::sub(V::gather(a.vy, idx), vyi);
+
+        sum_x = V::add(sum_x, V::select(m, V::fmadd(pressure, dx, V::mul(dvx, viscous))));
+        sum_y = V::add(sum_y, V::select(m, V::fmadd(pressure, dy, V::mul(dvy, viscous))));
+    }
+
+    fx = V::reduce(sum_x);
+    fy = V::reduce(sum_y);
+}
+
+template <typename V>
+void density_half_batch(const KernelArgs& a, int i, const int* nbr, int n, float* rho)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F xi = V::set1(a.px[i]), yi = V::set1(a.py[i]);
+    F h_sq = V::set1(a.h_sq);
+    F scale = V::set1(a.mass / a.h_sq5);
+    F zero = V::zero();
+    F sum = zero;
+    alignas(64) float w_j[V::width];
+
+    for (int k=0; k<n; k+=V::width)
+    {
+        typename V::I idx = load_candidates<V>(nbr, k, n, i);
+        F dx = V::sub(V::gather(a.px, idx), xi);
+        F dy = V::sub(V::gather(a.py, idx), yi);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+        M m = V::and_(V::lt(r_sq, h_sq), V::or_(V::neq(dx, zero), V::neq(dy, zero)));
+
+        F diff_sq = V::sub(h_sq, r_sq);
+        F w = V::select(m, V::mul(V::mul(V::mul(diff_sq, diff_sq), diff_sq), scale));
+        sum = V::add(sum, w);
+
+        // neighbors in one list are distinct, the scatter is done per lane since AVX2 has none
+        V::store(w_j, w);
+        int lanes = n - k < V::width ? n - k : V::width;
+        for (int t=0; t<lanes; t++)
+            rho[nbr[k + t]] += w_j[t];
+    }
+
+    rho[i] += V::reduce(sum);
+}
+
+template <typename V>
+void force_half_batch(const KernelArgs& a, int i, const int* nbr, int n, float* fx, float* fy)
+{
+    typedef typename V::F F;
+    typedef typename V::M M;
+
+    F xi = V::set1(a.px[i]), yi = V::set1(a.py[i]);
+    F vxi = V::set1(a.vx[i]), vyi = V::set1(a.vy[i]);
+    F pi = V::set1(a.pressure[i]);
+    F rho_i = V::set1(a.density[i]);
+    F h_sq = V::set1(a.h_sq);
+    F two_h_sq = V::set1(2.0f * a.h_sq);
+    F zero = V::zero();
+    F six = V::set1(6.0f);
+    F gradient_scale = V::set1(-6.0f / a.h_sq5);
+    F laplacian_scale = V::set1(6.0f / a.h_sq5 * a.visc);
+    F pressure_scale = V::set1(a.mass * -0.5f);
+    F sum_x = zero, sum_y = zero;
+    alignas(64) float fx_j[V::width];
+    alignas(64) float fy_j[V::width];
+
+    // the reaction on j only depends on i's density, so its mask is the same for every batch
+    bool i_has_density = a.density[i] != 0.0f;
+
+    for (int k=0; k<n; k+=V::width)
+    {
+        typename V::I idx = load_candidates<V>(nbr, k, n, i);
+        F dx = V::sub(V::gather(a.px, idx), xi);
+        F dy = V::sub(V::gather(a.py, idx), yi);
+        F r_sq = V::fmadd(dx, dx, V::mul(dy, dy));
+        M m = V::and_(V::lt(r_sq, h_sq), V::or_(V::neq(dx, zero), V::neq(dy, zero)));
+        F diff_sq = V::sub(h_sq, r_sq);
+
+        F rho_j = V::gather(a.density, idx);
+        F shared = V::mul(V::add(pi, V::gather(a.pressure, idx)), pressure_scale);
+        F gradient = V::mul(V::mul(diff_sq, diff_sq), gradient_scale);
+        F on_i = V::select(V::neq(rho_j, zero), V::div(shared, rho_j));
+        F on_j = i_has_density ? V::div(shared, rho_i) : zero;
+
+        F viscous = V::mul(V::mul(diff_sq, laplacian_scale), V::fmsub(six, r_sq, two_h_sq));
+        F visc_x = V::mul(V::sub(V::gather(a.vx, idx), vxi), viscous);
+        F visc_y = V::mul(V::sub(V::gather(a.vy, idx), vyi), viscous);
+
+        F grad_x = V::mul(gradient, dx);
+        F grad_y = V::mul(gradient, dy);
+        sum_x = V::add(sum_x, V::select(m, V::fmadd(on_i, grad_x, visc_x)));
+        sum_y = V::add(sum_y, V::select(m, V::fmadd(on_i, grad_y, visc_y)));
+
+        V::store(fx_j, V::select(m, V::fmadd(on_j, grad_x, visc_x)));
+        V::store(fy_j, V::select(m, V::fmadd(on_j, grad_y, visc_y)));
+        int lanes = n - k < V::width ? n - k : V::width;
+        for (int t=0; t<lanes; t++)
+        {
+            fx[nbr[k + t]] -= fx_j[t];
+            fy[nbr[k + t]] -= fy_j[t];
+        }
+    }
+
+    fx[i] += V::reduce(sum_x);
+    fy[i] += V::reduce(sum_y);
+}
+
+}
+
+#endif
@@ -6,6 +6,8 @@
 #include "GLFW/glfw3.h"
 #include "render.h"
 #include "simulation.h"
+#include "FrameScheduler.h"
+#include "profiler.h"
 #include "HashContainer.h"
 #include "BinaryPartitionContainer.h"
 
@@ -91,6 +93,9 @@ int main()
     // Simulation settings struct
     Simulation sim;
 
+    // Decides how many physics updates each frame takes
+    FrameScheduler scheduler;
+
     // Main loop
     while (!glfwWindowShouldClose(window))
     {
@@ -106,6 +111,11 @@ int main()
             continue;
         }
 
+        // Step the simulation by the time that passed, while it is behind the whole frame is skipped so no
+        // time goes to the GUI or waiting on vsync
+        if (!scheduler.run(sim))
+            continue;
+
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -118,11 +128,47 @@ int main()
 
             ImGui::SliderFloat("Smoothing Radius", &sim.smoothing_radius, 0.0, 1.0);
             ImGui::InputFloat("Timestep", &sim.timestep);
+            ImGui::Checkbox("Adaptive Timestep", &sim.adaptive_timestep);
+            if (sim.adaptive_timestep) {
+                ImGui::SliderFloat("Courant", &sim.courant, 0.05, 1.0);
+                ImGui::InputFloat("Min Timestep", &sim.min_timestep, 0.0f, 0.0f, "%.5f");
+                ImGui::InputFloat("Max Timestep", &sim.max_timestep, 0.0f, 0.0f, "%.5f");
+            }
+
+            // steps per second over the last half second of frames
+            static double rate_start = glfwGetTime();
+            static int rate_steps = sim.get_steps();
+            static float steps_per_second = 0.0f;
+            if (glfwGetTime() - rate_start >= 0.5) {
+                steps_per_second = (sim.get_steps() - rate_steps) / (glfwGetTime() - rate_start);
+                rate_start = glfwGetTime();
+                rate_steps = sim.get_steps();
+            }
+            ImGui::Text("Step %.5f s, %.0f steps/s, %.2f s simulated", sim.get_step_timestep(), steps_per_second, sim.get_time());
+            ImGui::SliderFloat("Speed", &scheduler.speed, 0.0, 2.0, "%.2f sim s/s");
+            ImGui::InputFloat("Physics Budget (ms)", &scheduler.budget_ms);
+            ImGui::Text("%d steps last frame, %.3f s behind, %d frames skipped",
+                        scheduler.get_frame_steps(), scheduler.get_lag(), scheduler.get_skipped_frames());
             ImGui::InputFloat("Gas Constant", &sim.gas_constant);
             ImGui::InputFloat("Gravity", &sim.gravity);
             ImGui::InputFloat("Target Density", &sim.target_density);
             ImGui::SliderFloat("Viscosity", &sim.viscosity, 0.0, 1.0);
             ImGui::DragInt("Particle Count", &sim.particle_count);
+            ImGui::InputInt("Reorder Interval", &sim.reorder_interval);
+            ImGui::SliderInt("Threads", &sim.threads, 1, std::max(1u, std::thread::hardware_concurrency()));
+            ImGui::Checkbox("Work Stealing", &sim.work_stealing);
+            ImGui::Checkbox("Neighbor Lists", &sim.neighbor_lists);
+            ImGui::InputFloat("Skin", &sim.skin);
+            ImGui::Checkbox("Symmetric Forces", &sim.symmetric_forces);
+            ImGui::Checkbox("Incremental Grid", &sim.incremental_grid);
+            ImGui::Checkbox("Cache Pairs", &sim.cache_pairs);
+            ImGui::Checkbox("Cell Blocks", &sim.cell_blocks);
+
+            const char* searches[] = { "Grid", "Hash", "Binary Partition", "Brute Force" };
+            int current_search = static_cast<int>(sim.search);
+            if (ImGui::Combo("Neighbor Search", &current_search, searches, IM_ARRAYSIZE(searches))) {
+                sim.search = static_cast<Simulation::Search>(current_search);
+            }
 
             // Particle pattern dropdown
             const char* patterns[] = { "Grid", "Circle", "Random" };
@@ -137,56 +183,7 @@ int main()
 
             ImGui::SameLine();
             if (ImGui::Button("Reset")) {
-                sim.get_particles().vec().clear();
-
-                float r = sim.smoothing_radius;
-                int count = sim.particle_count;
-
-                switch (sim.spawn_pattern) {
-                    case Simulation::Pattern::Grid: {
-                        int grid_dim = static_cast<int>(std::sqrt(count));
-                        float spacing = 1.5 / grid_dim;
-
-                        for (int i = 0; i < grid_dim; ++i) {
-                            for (int j = 0; j < grid_dim && sim.get_particles().vec().size() < count; ++j) {
-                                float x = (i - grid_dim / 2) * spacing;
-                                float y = (j - grid_dim / 2) * spacing;
-                                sim.get_particles().vec().emplace_back(x, y, 1.0f);
-                            }
-                        }
-                        break;
-                    }
-
-                    case Simulation::Pattern::Circle: {
-                        float max_radius = 0.8f; // normalized to viewport [-1, 1]
-                        float spacing = sim.smoothing_radius * 1.1f;
-                        int count = sim.particle_count;
-
-                        int placed = 0;
-                        for (float r = 0.0f; r <= max_radius && placed < count; r += spacing) {
-                            float circumference = 2.0f * 3.1415926f * r;
-                            int particles_in_ring = std::max(6, static_cast<int>(circumference / spacing));
-
-                            for (int j = 0; j < particles_in_ring && placed < count; ++j) {
-                                float angle = 2.0f * 3.1415926f * j / particles_in_ring;
-                                float x = std::cos(angle) * r;
-                                float y = std::sin(angle) * r;
-                                sim.get_particles().vec().emplace_back(x, y, 1.0f);
-                                placed++;
-                            }
-                        }
-                        break;
-                    }
-
-                    case Simulation::Pattern::Random: {
-                        for (int i = 0; i < count; ++i) {
-                            float x = ((rand() % 2000) / 1000.0f - 1.0f) * 0.8f;
-                            float y = ((rand() % 2000) / 1000.0f - 1.0f) * 0.8f;
-                            sim.get_particles().vec().emplace_back(x, y, 1.0f);
-                        }
-                        break;
-                    }
-                }
+                sim.reset();
             }
 
 
@@ -205,7 +202,7 @@ int main()
             ImGui::BeginChild("SimRender");
             ImVec2 pos = ImGui::GetCursorScreenPos();
             ImVec2 window_size = ImGui::GetWindowSize();
-            unsigned int texture = render_particles(sim.get_particles().vec(), render_info, window_size.x, window_size.y);
+            unsigned int texture = render_particles(sim.get_particles(), render_info, window_size.x, window_size.y);
             ImGui::GetWindowDrawList()->AddImage(
                     (ImTextureID)texture,
                     pos,
@@ -215,8 +212,10 @@ int main()
 
             // Grid Overlay Display for subdivision
             if (show_grid) {
-                int num_cols = (2.0 / (sim.smoothing_radius*3)) + 2;
-                int num_rows = (2.0 / (sim.smoothing_radius*3)) + 2;
+                // matches the cells of the simulation's GridContainer
+                int num_cols = GridContainer::grid_dim(sim.smoothing_radius);
+                int num_rows = num_cols;
+                float cell_size = 2.0 / num_cols;
                 float scaling_x = window_size.x / 2.0;
                 float scaling_y = window_size.y / 2.0;
 
@@ -226,13 +225,13 @@ int main()
 
                 // Draw vertical grid lines
                 for (int i = 0; i <= num_cols; ++i) {
-                    float x = pos.x + scaling_x*(i * sim.smoothing_radius*3 - 1.0);
+                    float x = pos.x + scaling_x*(i * cell_size);
                     draw_list->AddLine(ImVec2(x, pos.y), ImVec2(x, pos.y + window_size.y), grid_color);
                 }
 
-                // Draw horizontal grid lines
+                // Draw horizontal grid lines (the texture is flipped so y = -1 is at the bottom)
                 for (int j = 0; j <= num_rows; ++j) {
-                    float y = pos.y + scaling_y*(j * sim.smoothing_radius*3 - 1.0);
+                    float y = pos.y + scaling_y*(2.0 - j * cell_size);
                     draw_list->AddLine(ImVec2(pos.x, y), ImVec2(pos.x + window_size.x, y), grid_color);
                 }
             }
@@ -245,26 +244,138 @@ int main()
         if (show_debug_panel) {
             ImGui::Begin("Debug Tools");
 
-            const auto& particle_vec = sim.get_particles().vec();
-            ImGui::Text("Total Particles: %zu", particle_vec.size());
+            const auto& particles = sim.get_particles();
+            ImGui::Text("Total Particles: %d", particles.size());
+            ImGui::Text("Kernels: %s", select_kernels().name);
+            ImGui::Text("Neighbor List Builds: %d", sim.get_list_builds());
+
+            // busy time per thread during the last step, even bars mean the work is balanced
+            if (const ThreadPool* pool = sim.get_pool()) {
+                const auto& stats = pool->stats();
+                for (int t = 0; t < stats.size(); t++) {
+                    ImGui::Text("Thread %d: %.2f ms busy, %d tasks, %d steals",
+                                t, stats[t].busy, stats[t].tasks, stats[t].steals);
+                }
+            }
 
-            if (!particle_vec.empty()) {
-                const auto& p = particle_vec[0];
-                ImGui::Text("P[0] Position: (%.3f, %.3f)", p.px, p.py);
-                ImGui::Text("P[0] Velocity: (%.3f, %.3f)", p.vx, p.vy);
+            // recent duration of each phase, bars are samples oldest first
+            if (ImGui::CollapsingHeader("Timings")) {
+#ifndef FLUIDSIM_PROFILING
+                ImGui::TextDisabled("Profiling was compiled out, configure with FLUIDSIM_PROFILING=ON");
+#endif
+                static std::vector<float> samples;
+                for (int p = 0; p < PHASE_COUNT; p++) {
+                    Phase phase = static_cast<Phase>(p);
+                    Profiler::Summary s = profiler().summary(phase);
+                    if (s.samples == 0)
+                        continue;
+
+                    ImGui::Text("%-10s mean %.3f  p50 %.3f  p95 %.3f  max %.3f ms",
+                                phase_name(phase), s.mean, s.p50, s.p95, s.max);
+                    profiler().history(phase, samples);
+                    ImGui::PushID(p);
+                    ImGui::PlotHistogram("", samples.data(), samples.size(), 0, nullptr, 0.0f, s.max, ImVec2(0, 40));
+                    ImGui::PopID();
+                }
+
+                static bool dumped = false;
+                static bool dump_failed = false;
+                if (ImGui::Button("Dump Timings CSV")) {
+                    dumped = true;
+                    dump_failed = !profiler().write_csv("fluidsim_timings.csv");
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Clear Timings"))
+                    profiler().clear();
+                if (dumped)
+                    ImGui::Text("%s", dump_failed ? "Could not write fluidsim_timings.csv" : "Wrote fluidsim_timings.csv");
+            }
+
+            // per thread timelines for chrome://tracing or ui.perfetto.dev, also written on exit while recording
+            if (ImGui::CollapsingHeader("Trace")) {
+                bool recording = tracer().is_enabled();
+                if (ImGui::Checkbox("Record Trace", &recording))
+                    tracer().set_enabled(recording);
+
+                // the workers are idle between frames, so the rings can be read safely here
+                static bool exported = false;
+                static bool export_failed = false;
+                if (ImGui::Button("Export Trace")) {
+                    exported = true;
+                    export_failed = !tracer().write_json("fluidsim_trace.json");
+                }
+                ImGui::SameLine();
+                if (ImGui::Button("Clear Trace"))
+                    tracer().clear();
+                if (exported)
+                    ImGui::Text("%s", export_failed ? "Could not write fluidsim_trace.json" : "Wrote fluidsim_trace.json");
+            }
+
+            // hardware counters over the last occurrence of each phase
+            if (ImGui::CollapsingHeader("Counters")) {
+                PerfCounters& counters = perf_counters();
+                static bool open_failed = false;
+                if (!counters.is_open()) {
+#ifdef FLUIDSIM_PROFILING
+                    // opened on request since open counters keep counting every thread, read or not
+                    if (ImGui::Button("Open Counters")) {
+                        open_failed = !counters.open();
+                        counters.set_sampling(true);
+                        // counters only follow threads started after they open
+                        sim.restart_pool();
+                    }
+                    if (open_failed)
+                        ImGui::TextWrapped("Unavailable: %s", counters.status().c_str());
+#else
+                    ImGui::TextDisabled("Profiling was compiled out, configure with FLUIDSIM_PROFILING=ON");
+#endif
+                } else {
+                    bool sampling = counters.is_sampling();
+                    if (ImGui::Checkbox("Sample Counters", &sampling))
+                        counters.set_sampling(sampling);
+                    if (!counters.status().empty())
+                        ImGui::TextWrapped("Missing: %s", counters.status().c_str());
+
+                    double n = std::max(1, particles.size());
+                    double pairs = std::max(1LL, sim.get_pair_count());
+                    ImGui::Text("%lld candidate pairs last step", sim.get_pair_count());
+                    for (int p = 0; p < PHASE_COUNT; p++) {
+                        Phase phase = static_cast<Phase>(p);
+                        if (profiler().counted(phase) == 0)
+                            continue;
+
+                        const CounterReading& last = profiler().last_counters(phase);
+                        const double* v = last.values;
+                        if (counters.available(Counter::Cycles) && counters.available(Counter::Instructions) &&
+                            v[static_cast<int>(Counter::Cycles)] > 0.0)
+                            ImGui::Text("%s  IPC %.2f", phase_name(phase),
+                                        v[static_cast<int>(Counter::Instructions)] / v[static_cast<int>(Counter::Cycles)]);
+                        else
+                            ImGui::Text("%s", phase_name(phase));
+
+                        for (int k = 0; k < COUNTER_COUNT; k++) {
+                            if (!counters.available(static_cast<Counter>(k)))
+                                continue;
+                            if (phase_visits_pairs(phase))
+                                ImGui::Text("    %-14s %10.2f /particle %10.3f /candidate",
+                                            counter_name(static_cast<Counter>(k)), v[k] / n, v[k] / pairs);
+                            else
+                                ImGui::Text("    %-14s %10.2f /particle", counter_name(static_cast<Counter>(k)), v[k] / n);
+                        }
+                    }
+                }
+            }
+
+            if (particles.size() > 0) {
+                // storage may be reordered, so follow the particle by its id
+                int p = particles.slot(0);
+                ImGui::Text("P[0] Position: (%.3f, %.3f)", particles.px[p], particles.py[p]);
+                ImGui::Text("P[0] Velocity: (%.3f, %.3f)", particles.vx[p], particles.vy[p]);
             }
 
             ImGui::End();
         }
 
-        // Perform a physics update on the particles using physics wrapper
-    if (!sim.paused) {
-        // do several physics updates per frame
-        for (int i=0; i<2; i++)
-        {
-            sim.phys_update();
-        }
-    }
         // Rendering
         ImGui::Render();
         int display_w, display_h;
@@ -277,6 +388,9 @@ int main()
         glfwSwapBuffers(window);
     }
 
+    if (tracer().is_enabled() && !tracer().write_json("fluidsim_trace.json"))
+        std::cerr << "Could not write fluidsim_trace.json" << std::endl;
+
     // Cleanup
     ImGui_ImplOpenGL3_Shutdown();
     ImGui_ImplGlfw_Shutdown();
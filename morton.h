@@ -0,0 +1,34 @@
+#ifndef FLUIDSIM_MORTON_H
+#define FLUIDSIM_MORTON_H
+
+#include <cstdint>
+
+/// Spread the low 16 bits of x so there is a zero between each bit
+inline uint32_t morton_spread(uint32_t x)
+{
+    x &= 0x0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+/// Interleave two 16 bit coordinates into a Z-order curve index
+inline uint32_t morton_encode(uint32_t x, uint32_t y)
+{
+    return morton_spread(x) | (morton_spread(y) << 1);
+}
+
+/// Gather every other bit of x back into the low 16 bits, the inverse of morton_spread
+inline uint32_t morton_compact(uint32_t x)
+{
+    x &= 0x55555555;
+    x = (x | (x >> 1)) & 0x33333333;
+    x = (x | (x >> 2)) & 0x0f0f0f0f;
+    x = (x | (x >> 4)) & 0x00ff00ff;
+    x = (x | (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+#endif
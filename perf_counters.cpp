@@ -0,0 +1,133 @@
+#include "perf_counters.h"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char* counter_name(Counter c)
+{
+    static const char* const names[COUNTER_COUNT] = {"cycles", "instructions", "cache misses", "L1D misses",
+                                                     "branch misses", "task clock ns", "page faults"};
+    return names[static_cast<int>(c)];
+}
+
+PerfCounters::PerfCounters() : sampling(false), message("not opened")
+{
+    for (int& fd : fds)
+        fd = -1;
+}
+
+PerfCounters::~PerfCounters()
+{
+#ifdef __linux__
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+}
+
+#ifdef __linux__
+/// Type and config of each counter for perf_event_attr
+static void counter_event(Counter c, __u32& type, __u64& config)
+{
+    switch (c)
+    {
+        case Counter::Cycles: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_CPU_CYCLES; break;
+        case Counter::Instructions: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_INSTRUCTIONS; break;
+        case Counter::CacheMisses: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_CACHE_MISSES; break;
+        case Counter::L1DMisses:
+            type = PERF_TYPE_HW_CACHE;
+            config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case Counter::BranchMisses: type = PERF_TYPE_HARDWARE; config = PERF_COUNT_HW_BRANCH_MISSES; break;
+        case Counter::TaskClock: type = PERF_TYPE_SOFTWARE; config = PERF_COUNT_SW_TASK_CLOCK; break;
+        case Counter::PageFaults: type = PERF_TYPE_SOFTWARE; config = PERF_COUNT_SW_PAGE_FAULTS; break;
+        default: type = PERF_TYPE_SOFTWARE; config = PERF_COUNT_SW_DUMMY; break;
+    }
+}
+#endif
+
+bool PerfCounters::open()
+{
+    if (is_open())
+        return true;
+
+#ifdef __linux__
+    message.clear();
+    for (int k=0; k<COUNTER_COUNT; k++)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        counter_event(static_cast<Counter>(k), attr.type, attr.config);
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // count the workers started from this thread, and only user space so no extra privileges are needed
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fds[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[k] < 0)
+        {
+            if (!message.empty())
+                message += ", ";
+            message += std::string(counter_name(static_cast<Counter>(k))) + ": " + std::strerror(errno);
+        }
+    }
+#else
+    message = "hardware counters need Linux perf_event_open";
+#endif
+    return is_open();
+}
+
+bool PerfCounters::is_open() const
+{
+    for (int fd : fds)
+    {
+        if (fd >= 0)
+            return true;
+    }
+    return false;
+}
+
+bool PerfCounters::available(Counter c) const
+{
+    return fds[static_cast<int>(c)] >= 0;
+}
+
+const std::string& PerfCounters::status() const
+{
+    return message;
+}
+
+void PerfCounters::set_sampling(bool on)
+{
+    sampling = on && is_open();
+}
+
+void PerfCounters::read(CounterReading& out) const
+{
+    for (int k=0; k<COUNTER_COUNT; k++)
+    {
+        out.values[k] = 0.0;
+#ifdef __linux__
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (fds[k] < 0 || ::read(fds[k], data, sizeof(data)) != sizeof(data) || data[2] == 0)
+            continue;
+        out.values[k] = data[2] < data[1] ? static_cast<double>(data[0]) * data[1] / data[2] : data[0];
+#endif
+    }
+}
+
+PerfCounters& perf_counters()
+{
+    static PerfCounters instance;
+    return instance;
+}
@@ -0,0 +1,68 @@
+#ifndef FLUIDSIM_PERF_COUNTERS_H
+#define FLUIDSIM_PERF_COUNTERS_H
+
+#include <string>
+
+/// Counters read around each phase, hardware ones first
+enum class Counter {
+    Cycles,
+    Instructions,
+    // last level cache
+    CacheMisses,
+    L1DMisses,
+    BranchMisses,
+    // nanoseconds on a CPU, summed over threads
+    TaskClock,
+    PageFaults,
+    Count
+};
+
+constexpr int COUNTER_COUNT = static_cast<int>(Counter::Count);
+
+const char* counter_name(Counter c);
+
+/// Value of every counter at one moment, scaled up for any time the kernel multiplexed it out
+struct CounterReading
+{
+    double values[COUNTER_COUNT];
+};
+
+/// Linux perf_event_open counters of this process and every thread it starts after open
+///
+/// Counters only follow threads created after they are opened, so open them before the simulation
+/// first steps and creates its thread pool. Counters the kernel or CPU refuses are skipped, with the
+/// reason kept in status. Only user space is counted so a perf_event_paranoid of 2 is enough.
+class PerfCounters
+{
+    int fds[COUNTER_COUNT];
+    bool sampling;
+    std::string message;
+
+public:
+    PerfCounters();
+    ~PerfCounters();
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    /// Opens every counter the system allows, returns whether any opened
+    bool open();
+
+    bool is_open() const;
+    bool available(Counter c) const;
+
+    /// Why counters are missing, empty if all of them opened
+    const std::string& status() const;
+
+    /// Whether phases should read the counters, only possible once open
+    bool is_sampling() const { return sampling; }
+    void set_sampling(bool on);
+
+    /// Current value of every open counter, unavailable ones read as 0
+    void read(CounterReading& out) const;
+};
+
+/// Counters shared by the simulation and the front ends
+PerfCounters& perf_counters();
+
+#endif
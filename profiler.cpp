@@ -0,0 +1,123 @@
+#include "profiler.h"
+#include <algorithm>
+#include <fstream>
+
+const char* phase_name(Phase p)
+{
+    static const char* const names[PHASE_COUNT] = {"Step", "Neighbors", "Reorder", "Density", "Force", "Integrate", "Render"};
+    return names[static_cast<int>(p)];
+}
+
+bool phase_visits_pairs(Phase p)
+{
+    return p == Phase::Step || p == Phase::Density || p == Phase::Force;
+}
+
+Profiler::Profiler()
+{
+    clear();
+}
+
+void Profiler::record(Phase p, float ms)
+{
+    History& h = phases[static_cast<int>(p)];
+    h.samples[h.next] = ms;
+    h.next = (h.next + 1) % PROFILE_HISTORY;
+    h.count = std::min(h.count + 1, PROFILE_HISTORY);
+}
+
+void Profiler::record_counters(Phase p, const CounterReading& begin, const CounterReading& end)
+{
+    Counts& c = counts[static_cast<int>(p)];
+    for (int k=0; k<COUNTER_COUNT; k++)
+    {
+        c.last.values[k] = end.values[k] - begin.values[k];
+        c.total.values[k] += c.last.values[k];
+    }
+    ++c.occurrences;
+}
+
+const CounterReading& Profiler::last_counters(Phase p) const
+{
+    return counts[static_cast<int>(p)].last;
+}
+
+const CounterReading& Profiler::total_counters(Phase p) const
+{
+    return counts[static_cast<int>(p)].total;
+}
+
+int Profiler::counted(Phase p) const
+{
+    return counts[static_cast<int>(p)].occurrences;
+}
+
+Profiler::Summary Profiler::summary(Phase p) const
+{
+    Summary s = {0.0, 0.0, 0.0, 0.0, 0.0, 0};
+    std::vector<float> sorted;
+    history(p, sorted);
+    if (sorted.empty())
+        return s;
+
+    s.last = sorted.back();
+    s.samples = sorted.size();
+    float total = 0.0;
+    for (float ms : sorted)
+        total += ms;
+    s.mean = total / sorted.size();
+
+    std::sort(sorted.begin(), sorted.end());
+    s.p50 = sorted[sorted.size() / 2];
+    s.p95 = sorted[std::min<size_t>(sorted.size() - 1, sorted.size() * 95 / 100)];
+    s.max = sorted.back();
+    return s;
+}
+
+void Profiler::history(Phase p, std::vector<float>& out) const
+{
+    const History& h = phases[static_cast<int>(p)];
+    out.clear();
+    // the oldest sample is at next once the ring has wrapped
+    int first = h.count < PROFILE_HISTORY ? 0 : h.next;
+    for (int k=0; k<h.count; k++)
+        out.push_back(h.samples[(first + k) % PROFILE_HISTORY]);
+}
+
+void Profiler::clear()
+{
+    for (History& h : phases)
+    {
+        h.next = 0;
+        h.count = 0;
+    }
+    for (Counts& c : counts)
+    {
+        c.last = CounterReading();
+        c.total = CounterReading();
+        c.occurrences = 0;
+    }
+}
+
+bool Profiler::write_csv(const std::string& path) const
+{
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    out << "phase,sample,ms\n";
+    std::vector<float> samples;
+    for (int p=0; p<PHASE_COUNT; p++)
+    {
+        history(static_cast<Phase>(p), samples);
+        for (int k=0; k<samples.size(); k++)
+            out << phase_name(static_cast<Phase>(p)) << ',' << k << ',' << samples[k] << '\n';
+    }
+    return static_cast<bool>(out);
+}
+
+Profiler& profiler()
+{
+    static Profiler instance;
+    return instance;
+}
@@ -0,0 +1,145 @@
+#ifndef FLUIDSIM_PROFILER_H
+#define FLUIDSIM_PROFILER_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include "tracer.h"
+#include "perf_counters.h"
+
+/// Stages of a frame timed by the profiler
+enum class Phase {
+    // a whole phys_update
+    Step,
+    // grid binning and neighbor list builds, including any reorder
+    Neighbors,
+    Reorder,
+    Density,
+    // pressure and viscosity forces, also integrating each particle into the next buffers on the full passes
+    Force,
+    // integrating after the symmetric force pass, which can only start once every particle's force is summed
+    Integrate,
+    // copying particles out and drawing them
+    Render,
+    Count
+};
+
+constexpr int PHASE_COUNT = static_cast<int>(Phase::Count);
+
+// samples kept per phase for the rolling statistics
+constexpr int PROFILE_HISTORY = 240;
+
+const char* phase_name(Phase p);
+
+/// Whether a phase runs the kernels over candidate pairs, so its counters can be read per pair
+bool phase_visits_pairs(Phase p);
+
+/// Rolling window of the most recent durations of each phase
+///
+/// Samples are only recorded by the thread driving the simulation and rendering, so there is no locking
+class Profiler
+{
+    struct History {
+        // milliseconds, a ring buffer with the next write at next
+        float samples[PROFILE_HISTORY];
+        int next;
+        int count;
+    };
+    History phases[PHASE_COUNT];
+
+    // counter deltas of the last occurrence of each phase and their sum since the last clear
+    struct Counts {
+        CounterReading last;
+        CounterReading total;
+        int occurrences;
+    };
+    Counts counts[PHASE_COUNT];
+
+public:
+    /// Statistics of the samples currently in a phase's window, all in milliseconds
+    struct Summary {
+        float last;
+        float mean;
+        float p50;
+        float p95;
+        float max;
+        int samples;
+    };
+
+    Profiler();
+
+    void record(Phase p, float ms);
+
+    /// Adds the counter deltas between two readings taken around a phase
+    void record_counters(Phase p, const CounterReading& begin, const CounterReading& end);
+
+    Summary summary(Phase p) const;
+
+    /// Samples in a phase's window, oldest first
+    void history(Phase p, std::vector<float>& out) const;
+
+    /// Counter deltas over the last occurrence of a phase
+    const CounterReading& last_counters(Phase p) const;
+
+    /// Counter deltas summed over every occurrence since the last clear
+    const CounterReading& total_counters(Phase p) const;
+
+    /// Occurrences of a phase with counters recorded since the last clear
+    int counted(Phase p) const;
+
+    void clear();
+
+    /// Writes every sample in the windows as phase,sample,ms rows
+    bool write_csv(const std::string& path) const;
+};
+
+/// Profiler shared by the simulation and the front ends
+Profiler& profiler();
+
+/// Records the time from construction to destruction under a phase
+///
+/// Also adds a span when tracing and reads the hardware counters around the phase while sampling them
+class ScopedTimer
+{
+    Phase phase;
+    bool counting;
+    CounterReading begin_counts;
+    std::chrono::steady_clock::time_point begin;
+
+public:
+    explicit ScopedTimer(Phase p) : phase(p), counting(perf_counters().is_sampling())
+    {
+        if (counting)
+            perf_counters().read(begin_counts);
+        begin = std::chrono::steady_clock::now();
+    }
+    ~ScopedTimer()
+    {
+        auto end = std::chrono::steady_clock::now();
+        if (counting)
+        {
+            CounterReading end_counts;
+            perf_counters().read(end_counts);
+            profiler().record_counters(phase, begin_counts, end_counts);
+        }
+
+        std::chrono::duration<float, std::milli> elapsed = end - begin;
+        profiler().record(phase, elapsed.count());
+        if (tracer().is_enabled())
+            tracer().record(phase_name(phase), begin, end);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
+
+// times the rest of the enclosing scope, compiled out entirely unless FLUIDSIM_PROFILING is defined
+#ifdef FLUIDSIM_PROFILING
+#define FLUIDSIM_PROFILE_CONCAT_(a, b) a##b
+#define FLUIDSIM_PROFILE_CONCAT(a, b) FLUIDSIM_PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(phase) ScopedTimer FLUIDSIM_PROFILE_CONCAT(profile_scope_, __LINE__)(phase)
+#else
+#define PROFILE_SCOPE(phase) ((void)0)
+#endif
+
+#endif
@@ -1,4 +1,6 @@
 #include "render.h"
+#include "profiler.h"
+#include "tracer.h"
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -6,8 +8,17 @@
 #include <GLFW/glfw3.h>
 #include "shaders.h"
 
-unsigned render_particles(const std::vector<Particle>& particles, GLRenderInfo info, int width, int height)
+unsigned render_particles(const ParticleStore& store, GLRenderInfo info, int width, int height)
 {
+    PROFILE_SCOPE(Phase::Render);
+
+    // interleaved copy of the store for the vertex buffer, kept to reuse its allocation
+    static std::vector<Particle> particles;
+    {
+        TRACE_SCOPE("Copy");
+        store.to_aos(particles);
+    }
+
     glUseProgram(info.p_prog);
     glBindVertexArray(info.p_vao);
 
@@ -23,7 +34,11 @@ unsigned render_particles(const std::vector<Particle>& particles, GLRenderInfo i
     glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, info.p_rbo);
 
     glBindBuffer(GL_ARRAY_BUFFER, info.p_vbo);
-    glBufferData(GL_ARRAY_BUFFER, particles.size()*sizeof(Particle), particles.data(), GL_DYNAMIC_DRAW);
+    {
+        // stalls here when the driver still holds the previous frame's buffer
+        TRACE_SCOPE("Upload");
+        glBufferData(GL_ARRAY_BUFFER, particles.size()*sizeof(Particle), particles.data(), GL_DYNAMIC_DRAW);
+    }
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Particle), (void*)0);
     glEnableVertexAttribArray(0);
 
@@ -2,7 +2,7 @@
 #define FLUIDSIM_RENDER_H
 
 #include <vector>
-#include "Particle.h"
+#include "ParticleStore.h"
 #include <string>
 
 /// Stores relevant information about particle OpenGL state
@@ -16,7 +16,7 @@ struct GLRenderInfo {
 };
 
 /// Renders all particles to a texture and return the texture id
-unsigned int render_particles(const std::vector<Particle>& particles, GLRenderInfo info, int width, int height);
+unsigned int render_particles(const ParticleStore& particles, GLRenderInfo info, int width, int height);
 
 /// Load a program for OpenGL to use
 void load_shader(const std::string& filename);
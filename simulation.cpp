@@ -1,134 +1,565 @@
 #include "simulation.h"
+#include "profiler.h"
+#include <cmath>
+#include <cstdlib>
+
+// tasks handed to each thread up front, more leaves more room to rebalance dense regions
+constexpr int TASKS_PER_THREAD = 16;
 
 /// Perform a physics update on all particles
 ///
-/// 1. duplicate particle container
+/// 1. rebuild the neighbor grid and lists when needed
 /// 2. calculate densities
 /// 3. calculate pressure gradient
 /// 4. calculate viscosity
 /// 5. apply all forces
 /// 6. apply velocity
+///
+/// Steps 5 and 6 run per particle as soon as its force is known, writing the store's next buffers
 void Simulation::phys_update()
 {
-    particles.update(smoothing_radius);
-    std::vector<Particle> out(particles.vec());
+    PROFILE_SCOPE(Phase::Step);
 
-    for (int i=0; i<out.size(); i++)
+    threads = std::max(1, threads);
+    if (!pool || pool->size() != threads)
     {
-        Particle& p = get_particles().vec()[i];
-        Particle& p_out = out[i];
+        pool.reset(new ThreadPool(threads));
+        candidates.resize(threads);
+        pair_counts.resize(threads);
+        pair_buffers.resize(threads);
+        step_limits.resize(threads);
+    }
+    pool->reset_stats();
+
+    step_dt = adaptive_timestep ? stable_timestep() : timestep;
 
-        p_out.px += p.vx * timestep;
-        p_out.py += p.vy * timestep;
-        p_out.vy -= gravity * timestep;
+    // symmetric forces need half lists, without caching they are rebuilt every step with no skin
+    bool use_lists = neighbor_lists || symmetric_forces;
+    float list_skin = neighbor_lists ? skin : 0.0f;
 
-        // bounds checks
-        if (p_out.px > 1.0)
+    // the grid is only rebuilt with the neighbor lists, which last until particles move too far
+    if (!neighbor_lists)
+        lists.invalidate();
+    {
+        PROFILE_SCOPE(Phase::Neighbors);
+        // other searches still use the grid to pick the Morton order
+        bool grid_search = use_lists || search == Search::Grid;
+        bool reorder = reorder_interval > 0 && (last_reorder < 0 || steps - last_reorder >= reorder_interval);
+        if (!neighbor_lists || lists.stale(particles, smoothing_radius, list_skin, symmetric_forces, *pool))
         {
-            p_out.px = 1.0;
-            p_out.vx *= -0.5;
-            p_out.vy *= 0.5;
+            if (grid_search || reorder)
+            {
+                grid.set_incremental(incremental_grid);
+                grid.update(particles, smoothing_radius + list_skin);
+            }
+            if (reorder)
+            {
+                PROFILE_SCOPE(Phase::Reorder);
+                grid.sort_morton(particles, *pool);
+                last_reorder = steps;
+            }
+
+            if (use_lists)
+            {
+                lists.build(particles, grid, smoothing_radius, list_skin, symmetric_forces, *pool);
+                ++list_builds;
+            }
         }
-        if (p_out.px < -1.0)
+
+        if (!grid_search)
         {
-            p_out.px = -1.0;
-            p_out.vx *= -0.5;
-            p_out.vy *= 0.5;
+            if (search == Search::Hash)
+                hash.update(particles, smoothing_radius);
+            else if (search == Search::BinaryPartition && (pool->size() == 1 || particles.size() < TREE_PARALLEL_MIN))
+                tree.update(particles, smoothing_radius);
+            else if (search == Search::BinaryPartition)
+                tree.update(particles, smoothing_radius, *pool);
+            else
+                brute_force.update(particles, smoothing_radius);
         }
-        if (p_out.py > 1.0)
+        cell_tasks = grid_search;
+    }
+
+    // pairs are evaluated in batches by the widest kernels the CPU supports
+    const KernelSet& kernels = select_kernels();
+    KernelArgs args = make_kernel_args(particles.px.data(), particles.py.data(), particles.vx.data(),
+                                       particles.vy.data(), particles.density.data(), particles.pressure.data(),
+                                       smoothing_radius, mass, viscosity);
+
+    // every pass only writes to the particles it is given
+    // each pass returns once all threads finish, which is the barrier between passes
+    if (symmetric_forces)
+    {
+        // half list pairs were found by the grid the lists were built on, so they lie within reach cells
+        int n = particles.size();
+        int reach = grid.reach(smoothing_radius + list_skin);
+        pairs = lists.begin(n) - lists.begin(0);
+
+        // calculate densities, then pressures once every pair has been added
         {
-            p_out.py = 1.0;
-            p_out.vy *= -0.5;
-            p_out.vx *= 0.5;
+            PROFILE_SCOPE(Phase::Density);
+            std::fill(particles.density.begin(), particles.density.end(), 0.0f);
+            for_each_coloured_particle(reach, [&](int i, int thread) {
+                kernels.density_half(args, i, lists.begin(i), lists.count(i), particles.density.data());
+            }, "Density");
+            pool->parallel_for(n, [&](int begin, int end, int thread) {
+                for (int i=begin; i<end; i++)
+                    particles.pressure[i] = gas_constant / 10000.0 * (target_density - particles.density[i]);
+            }, "Pressure");
         }
-        if (p_out.py < -1.0)
+
+        // calculate pressure and viscosity forces the same way
         {
-            p_out.py = -1.0;
-            p_out.vy *= -0.5;
-            p_out.vx *= 0.5;
+            PROFILE_SCOPE(Phase::Force);
+            std::fill(particles.fx.begin(), particles.fx.end(), 0.0f);
+            std::fill(particles.fy.begin(), particles.fy.end(), 0.0f);
+            for_each_coloured_particle(reach, [&](int i, int thread) {
+                kernels.force_half(args, i, lists.begin(i), lists.count(i), particles.fx.data(), particles.fy.data());
+            }, "Force");
         }
 
-        // give a nudge away from floor
-        if (p_out.py < -0.98)
+        // a particle's force is only complete once every colour has run, so integrating is its own pass
         {
-            //p_out.vy += 2 * gravity * timestep;
+            PROFILE_SCOPE(Phase::Integrate);
+            pool->parallel_for(n, [&](int begin, int end, int thread) {
+                for (int i=begin; i<end; i++)
+                    integrate(i);
+            }, "Integrate");
+            particles.swap_next();
         }
     }
+    else
+    {
+        // every particle is integrated into the next buffers by the force pass, so its time is part of Force
+        if (neighbor_lists || search == Search::Grid)
+            full_passes(grid, kernels, args);
+        else if (search == Search::Hash)
+            full_passes(hash, kernels, args);
+        else if (search == Search::BinaryPartition)
+            full_passes(tree, kernels, args);
+        else
+            full_passes(brute_force, kernels, args);
+        particles.swap_next();
+    }
+
+    ++steps;
+    time += step_dt;
+}
+
+float Simulation::stable_timestep()
+{
+    for (StepLimits& l : step_limits)
+        l = StepLimits{0.0f, 0.0f, 0.0f};
+    pool->parallel_for(particles.size(), [&](int begin, int end, int thread) {
+        StepLimits& l = step_limits[thread];
+        for (int i=begin; i<end; i++)
+        {
+            float ay = particles.fy[i] - gravity;
+            l.v_sq = std::max(l.v_sq, particles.vx[i] * particles.vx[i] + particles.vy[i] * particles.vy[i]);
+            l.a_sq = std::max(l.a_sq, particles.fx[i] * particles.fx[i] + ay * ay);
+            l.density = std::max(l.density, particles.density[i]);
+        }
+    }, "Step limits");
+    StepLimits limit = {0.0f, 0.0f, 0.0f};
+    for (const StepLimits& l : step_limits)
+    {
+        limit.v_sq = std::max(limit.v_sq, l.v_sq);
+        limit.a_sq = std::max(limit.a_sq, l.a_sq);
+        limit.density = std::max(limit.density, l.density);
+    }
+
+    float h = smoothing_radius;
+    float dt = max_timestep;
+    if (limit.v_sq > 0.0f)
+        dt = std::min(dt, courant * h / std::sqrt(limit.v_sq));
+    if (limit.a_sq > 0.0f)
+        dt = std::min(dt, courant * std::sqrt(h / std::sqrt(limit.a_sq)));
+
+    // a neighborhood holds about 4 density h^4 / mass particles, each pulling the velocity towards its own
+    // with a weight of at most 12 visc / h^6, and the explicit update overshoots once dt times their sum passes 1
+    float visc = viscosity / 1000000.0 * 0.5;
+    if (visc > 0.0f && limit.density > 0.0f)
+        dt = std::min(dt, courant * h * h * mass / (48.0f * limit.density * visc));
+
+    return std::max(min_timestep, dt);
+}
+
+template <typename Container>
+void Simulation::full_passes(Container& c, const KernelSet& kernels, const KernelArgs& args)
+{
+    if (cache_pairs)
+    {
+        // calculate densities and pressures, recording every neighbor inside the radius
+        {
+            PROFILE_SCOPE(Phase::Density);
+            int n = particles.size();
+            pair_owner.resize(n);
+            pair_begin.resize(n);
+            pair_count.resize(n);
+            for (int t=0; t<threads; t++)
+            {
+                pair_counts[t].pairs = 0;
+                pair_buffers[t].used = 0;
+            }
+            for_each_neighborhood(c, [&](int i, int thread, const int* nbr, int count) {
+                pair_counts[thread].pairs += count;
 
-    // calculate densities and pressures
-    std::vector<float> densities(out.size(), 0.0);
-    std::vector<float> pressures(out.size(), 0.0);
-    for (int i=0; i<out.size(); i++)
+                // grown buffers keep their size for the following steps
+                PairBuffer& buffer = pair_buffers[thread];
+                int room = buffer.used + count + kernels.width;
+                if (buffer.j.size() < room)
+                {
+                    int size = std::max<int>(room, 2 * buffer.j.size());
+                    buffer.j.resize(size);
+                    buffer.dx.resize(size);
+                    buffer.dy.resize(size);
+                }
+
+                PairCache cache = {buffer.j.data() + buffer.used, buffer.dx.data() + buffer.used,
+                                   buffer.dy.data() + buffer.used, 0};
+                particles.density[i] = kernels.density_cache(args, i, nbr, count, cache);
+                particles.pressure[i] = gas_constant / 10000.0 * (target_density - particles.density[i]);
+
+                pair_owner[i] = thread;
+                pair_begin[i] = buffer.used;
+                pair_count[i] = cache.count;
+                buffer.used += (cache.count + kernels.width - 1) / kernels.width * kernels.width;
+            }, "Density");
+            pairs = 0;
+            for (const PairCount& c : pair_counts)
+                pairs += c.pairs;
+        }
+
+        // calculate pressure and viscosity forces from the recorded pairs and integrate
+        {
+            PROFILE_SCOPE(Phase::Force);
+            for_each_particle([&](int i, int thread) {
+                PairBuffer& buffer = pair_buffers[pair_owner[i]];
+                PairCache cache = {buffer.j.data() + pair_begin[i], buffer.dx.data() + pair_begin[i],
+                                   buffer.dy.data() + pair_begin[i], pair_count[i]};
+                kernels.force_cached(args, i, cache, particles.fx[i], particles.fy[i]);
+                integrate(i);
+            }, "Force");
+        }
+    }
+    else
     {
-        Particle& p1 = particles.vec()[i];
+        // calculate densities and pressures
+        {
+            PROFILE_SCOPE(Phase::Density);
+            for (PairCount& c : pair_counts)
+                c.pairs = 0;
+            for_each_neighborhood(c, [&](int i, int thread, const int* nbr, int count) {
+                pair_counts[thread].pairs += count;
+                particles.density[i] = kernels.density(args, i, nbr, count);
+                particles.pressure[i] = gas_constant / 10000.0 * (target_density - particles.density[i]);
+            }, "Density");
+            pairs = 0;
+            for (const PairCount& c : pair_counts)
+                pairs += c.pairs;
+        }
 
-        for (auto p2 = particles.nearest(i, smoothing_radius); !p2.done(); ++p2)
+        // calculate pressure and viscosity forces and integrate, neighbors still read the current state
         {
-            if (p1.px == (*p2).px && p1.py == (*p2).py) continue;
-            densities[i] += mass * kernel(p1, *p2);
+            PROFILE_SCOPE(Phase::Force);
+            for_each_neighborhood(c, [&](int i, int thread, const int* nbr, int count) {
+                kernels.force(args, i, nbr, count, particles.fx[i], particles.fy[i]);
+                integrate(i);
+            }, "Force");
+        }
+    }
+}
+
+void Simulation::integrate(int i)
+{
+    float p_px = particles.px[i];
+    float p_py = particles.py[i];
+    float p_vx = particles.vx[i];
+    float p_vy = particles.vy[i];
+
+    p_px += p_vx * step_dt;
+    p_py += p_vy * step_dt;
+    p_vy -= gravity * step_dt;
+
+    // bounds checks
+    if (p_px > 1.0)
+    {
+        p_px = 1.0;
+        p_vx *= -0.5;
+        p_vy *= 0.5;
+    }
+    if (p_px < -1.0)
+    {
+        p_px = -1.0;
+        p_vx *= -0.5;
+        p_vy *= 0.5;
+    }
+    if (p_py > 1.0)
+    {
+        p_py = 1.0;
+        p_vy *= -0.5;
+        p_vx *= 0.5;
+    }
+    if (p_py < -1.0)
+    {
+        p_py = -1.0;
+        p_vy *= -0.5;
+        p_vx *= 0.5;
+    }
+
+    // give a nudge away from floor
+    if (p_py < -0.98)
+    {
+        //p_vy += 2 * gravity * step_dt;
+    }
+
+    p_vx += step_dt * particles.fx[i];
+    p_vy += step_dt * particles.fy[i];
+
+    particles.next_px[i] = p_px;
+    particles.next_py[i] = p_py;
+    particles.next_vx[i] = p_vx;
+    particles.next_vy[i] = p_vy;
+}
+
+void Simulation::reset()
+{
+    particles.clear();
+    lists.invalidate();
+    last_reorder = -1;
+    time = 0.0;
+
+    int count = particle_count;
+
+    switch (spawn_pattern) {
+        case Pattern::Grid: {
+            int grid_dim = static_cast<int>(std::sqrt(count));
+            float spacing = 1.5 / grid_dim;
+
+            for (int i = 0; i < grid_dim; ++i) {
+                for (int j = 0; j < grid_dim && particles.size() < count; ++j) {
+                    float x = (i - grid_dim / 2) * spacing;
+                    float y = (j - grid_dim / 2) * spacing;
+                    particles.insert(Particle(x, y, 1.0f));
+                }
+            }
+            break;
+        }
+
+        case Pattern::Circle: {
+            float max_radius = 0.8f; // normalized to viewport [-1, 1]
+            float spacing = smoothing_radius * 1.1f;
+
+            int placed = 0;
+            for (float r = 0.0f; r <= max_radius && placed < count; r += spacing) {
+                float circumference = 2.0f * 3.1415926f * r;
+                int particles_in_ring = std::max(6, static_cast<int>(circumference / spacing));
+
+                for (int j = 0; j < particles_in_ring && placed < count; ++j) {
+                    float angle = 2.0f * 3.1415926f * j / particles_in_ring;
+                    float x = std::cos(angle) * r;
+                    float y = std::sin(angle) * r;
+                    particles.insert(Particle(x, y, 1.0f));
+                    placed++;
+                }
+            }
+            break;
         }
-        pressures[i] = gas_constant / 10000.0 * (target_density - densities[i]);
+
+        case Pattern::Random: {
+            for (int i = 0; i < count; ++i) {
+                float x = ((rand() % 2000) / 1000.0f - 1.0f) * 0.8f;
+                float y = ((rand() % 2000) / 1000.0f - 1.0f) * 0.8f;
+                particles.insert(Particle(x, y, 1.0f));
+            }
+            break;
+        }
+    }
+}
+
+template <typename Fn>
+void Simulation::for_each_particle(const Fn& fn, const char* name)
+{
+    if (!work_stealing)
+    {
+        pool->parallel_for(particles.size(), [&](int begin, int end, int thread) {
+            for (int i=begin; i<end; i++)
+                fn(i, thread);
+        }, name);
+        return;
     }
 
-    // calculate pressure and viscosity forces
-    for (int i=0; i<out.size(); i++)
+    // particles are stored in Morton order, so without the grid blocks of them are still close together
+    if (!cell_tasks)
     {
-        Particle& p1 = particles.vec()[i];
-        std::pair<float, float> force = {0.0, 0.0};
+        int n = particles.size();
+        int block = std::max(1, n / (pool->size() * TASKS_PER_THREAD));
+        pool->run_tasks((n + block - 1) / block, [&](int task, int thread) {
+            int last = std::min(n, (task + 1) * block);
+            for (int i = task * block; i < last; i++)
+                fn(i, thread);
+        }, name);
+        return;
+    }
 
-        for (auto p2 = particles.nearest(i, smoothing_radius); !p2.done(); ++p2)
+    for_each_cell([&](int cell, int thread) {
+        for (const int* i = grid.begin_of(cell); i != grid.end_of(cell); ++i)
+            fn(*i, thread);
+    }, name);
+}
+
+template <typename Fn>
+void Simulation::for_each_cell(const Fn& fn, const char* name)
+{
+    int cells = grid.cell_count();
+    if (!work_stealing)
+    {
+        pool->parallel_for(cells, [&](int begin, int end, int thread) {
+            for (int cell=begin; cell<end; cell++)
+                fn(cell, thread);
+        }, name);
+        return;
+    }
+
+    // tasks are blocks of grid cells so dense blocks can be picked up by idle threads
+    int block = std::max(1, cells / (pool->size() * TASKS_PER_THREAD));
+    int tasks = (cells + block - 1) / block;
+    pool->run_tasks(tasks, [&](int task, int thread) {
+        int last = std::min(cells, (task + 1) * block);
+        for (int cell = task * block; cell < last; cell++)
+            fn(cell, thread);
+    }, name);
+}
+
+template <typename Fn>
+void Simulation::for_each_coloured_particle(int reach, const Fn& fn, const char* name)
+{
+    int dim = grid.cells_per_axis();
+    int stride = 2 * reach + 1;
+    for (int colour=0; colour<stride*stride; colour++)
+    {
+        // cells of this colour form a coarser grid starting at the colour's offset
+        int ox = colour % stride;
+        int oy = colour / stride;
+        int nx = (dim - ox + stride - 1) / stride;
+        int ny = (dim - oy + stride - 1) / stride;
+        auto run_cell = [&](int k, int thread) {
+            int cell = (oy + (k / nx) * stride) * dim + ox + (k % nx) * stride;
+            for (const int* i = grid.begin_of(cell); i != grid.end_of(cell); ++i)
+                fn(*i, thread);
+        };
+
+        // each colour returns once all threads finish, which is the barrier before the next
+        if (!work_stealing)
         {
-            if (p1.px == (*p2).px && p1.py == (*p2).py) continue;
-            auto gradient = kernel_gradient(p1, *p2);
-            float componentless = 0.0;
-            if (densities[p2.idx()] != 0.0)
-                componentless = (pressures[i] + pressures[p2.idx()]) * mass * -0.5 / densities[p2.idx()];
-            force.first += componentless * gradient.first;
-            force.second += componentless * gradient.second;
-
-            componentless = viscosity / 1000000.0 * 0.5 * kernel_laplacian(p1, *p2);
-            force.first += ((*p2).vx - p1.vx) * componentless;
-            force.second += ((*p2).vy - p1.vy) * componentless;
+            pool->parallel_for(nx * ny, [&](int begin, int end, int thread) {
+                for (int k=begin; k<end; k++)
+                    run_cell(k, thread);
+            }, name);
         }
+        else
+            pool->run_tasks(nx * ny, run_cell, name);
+    }
+}
+
+template <typename Container, typename Fn>
+void Simulation::for_each_neighborhood(Container& c, const Fn& fn, const char* name)
+{
+    for_each_particle([&](int i, int thread) {
+        auto nbr = neighbors_of(c, i, thread);
+        fn(i, thread, nbr.first, nbr.second);
+    }, name);
+}
 
-        Particle& p1out = out[i];
-        p1out.vx += timestep * force.first;
-        p1out.vy += timestep * force.second;
+template <typename Fn>
+void Simulation::for_each_neighborhood(GridContainer& c, const Fn& fn, const char* name)
+{
+    // neighbor lists are already per particle
+    if (!cell_blocks || neighbor_lists)
+    {
+        for_each_particle([&](int i, int thread) {
+            auto nbr = neighbors_of(c, i, thread);
+            fn(i, thread, nbr.first, nbr.second);
+        }, name);
+        return;
     }
 
-    particles.vec() = out;
+    // the candidates stay in cache while the kernels run every particle of the cell over them
+    for_each_cell([&](int cell, int thread) {
+        if (c.begin_of(cell) == c.end_of(cell))
+            return;
+        std::vector<int>& nbr = candidates[thread];
+        nbr.clear();
+        c.cell_candidates(cell, smoothing_radius, nbr);
+        for (const int* i = c.begin_of(cell); i != c.end_of(cell); ++i)
+            fn(*i, thread, nbr.data(), static_cast<int>(nbr.size()));
+    }, name);
 }
 
-ParticleContainer &Simulation::get_particles()
+template <typename Container>
+std::pair<const int*, int> Simulation::neighbors_of(Container& c, int i, int thread)
 {
-    return particles;
+    if (neighbor_lists)
+        return {lists.begin(i), lists.count(i)};
+
+    std::vector<int>& nbr = candidates[thread];
+    nbr.clear();
+    gather(c, i, nbr);
+    return {nbr.data(), static_cast<int>(nbr.size())};
+}
+
+template <typename Container>
+void Simulation::gather(Container& c, int i, std::vector<int>& out)
+{
+    c.for_each_neighbor(i, smoothing_radius, [&](int j) { out.push_back(j); });
 }
 
-float Simulation::kernel(const Particle &p1, const Particle &p2)
+void Simulation::gather(GridContainer& c, int i, std::vector<int>& out)
 {
-    float dx = p2.px - p1.px, dy = p2.py - p1.py;
-    float r_sq = dx*dx + dy*dy;
-    float r_sm_sq = smoothing_radius*smoothing_radius;
-    float diff_sq = r_sm_sq - r_sq;
-    return diff_sq*diff_sq*diff_sq / (r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq);
+    c.candidates(i, smoothing_radius, out);
 }
 
-std::pair<float, float> Simulation::kernel_gradient(const Particle &p1, const Particle &p2)
+long long Simulation::get_pair_count() const
 {
-    float dx = p2.px - p1.px, dy = p2.py - p1.py;
-    float r_sq = dx*dx + dy*dy;
-    float r_sm_sq = smoothing_radius*smoothing_radius;
-    float diff_sq = r_sm_sq - r_sq;
-    float componentless_part = -6.0 * diff_sq*diff_sq / (r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq);
-    return {componentless_part * dx, componentless_part * dy};
+    return pairs;
 }
 
-float Simulation::kernel_laplacian(const Particle &p1, const Particle &p2)
+float Simulation::get_step_timestep() const
 {
-    float dx = p1.px - p2.px, dy = p1.py - p2.py;
-    float r_sq = dx*dx + dy*dy;
-    float r_sm_sq = smoothing_radius*smoothing_radius;
-    float diff_sq = r_sm_sq - r_sq;
-    float componentless_part = 6.0 * diff_sq / (r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq*r_sm_sq);
-    return componentless_part * (6.0*r_sq - 2.0*r_sm_sq);
+    return step_dt;
+}
+
+int Simulation::get_steps() const
+{
+    return steps;
+}
+
+double Simulation::get_time() const
+{
+    return time;
+}
+
+int Simulation::get_list_builds() const
+{
+    return list_builds;
+}
+
+const ThreadPool* Simulation::get_pool() const
+{
+    return pool.get();
+}
+
+void Simulation::restart_pool()
+{
+    pool.reset();
+}
+
+ParticleStore &Simulation::get_particles()
+{
+    return particles;
+}
+
+const ParticleStore &Simulation::get_particles() const
+{
+    return particles;
 }
@@ -3,22 +3,127 @@
 
 #include <vector>
 #include <array>
-#include "particle.h"
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include "Particle.h"
+#include "ParticleStore.h"
 #include "ParticleContainer.h"
 #include "HashContainer.h"
 #include "BinaryPartitionContainer.h"
+#include "GridContainer.h"
+#include "kernels.h"
+#include "ThreadPool.h"
+#include "NeighborList.h"
 
 class Simulation {
-    HashContainer particles;
+    ParticleStore particles;
+    GridContainer grid;
+    // the other neighbor searches, only updated while selected
+    HashContainer hash;
+    BinaryPartitionContainer tree;
+    ParticleContainer brute_force;
+    // whether this step's tasks can be blocks of grid cells
+    bool cell_tasks;
 
-    /// Calculate the kernel between two particles
-    float kernel(const Particle& p1, const Particle& p2);
+    NeighborList lists;
 
-    /// Calculate gradient of the kernel between two particles
-    std::pair<float, float> kernel_gradient(const Particle& p1, const Particle& p2);
+    // physics updates performed so far
+    int steps;
+    // step of the last Morton reorder, -1 before the first
+    int last_reorder;
+    // times the neighbor lists were rebuilt
+    int list_builds;
+    // candidate pairs evaluated by the last density pass
+    long long pairs;
+    // timestep used by the last update
+    float step_dt;
+    // simulated time since the last reset
+    double time;
 
-    /// Calculate laplacian of the kernel between two particles
-    float kernel_laplacian(const Particle& p1, const Particle& p2);
+    // workers for the particle passes, rebuilt when the thread setting changes
+    std::unique_ptr<ThreadPool> pool;
+
+    // neighbor candidates of the particle each thread is updating, kept to reuse the allocations
+    std::vector<std::vector<int>> candidates;
+
+    // candidate pairs counted by each thread, padded so threads don't share cache lines
+    struct PairCount {
+        long long pairs;
+        char pad[56];
+    };
+    std::vector<PairCount> pair_counts;
+
+    // fastest particle, largest acceleration and highest density seen by each thread, padded like PairCount
+    struct StepLimits {
+        float v_sq, a_sq, density;
+        char pad[52];
+    };
+    std::vector<StepLimits> step_limits;
+
+    // neighbors within the radius recorded by each thread's density pass for the force pass
+    struct PairBuffer {
+        std::vector<int> j;
+        AlignedVector<float> dx, dy;
+        // pairs recorded so far this step, padding included
+        int used;
+        char pad[60];
+    };
+    std::vector<PairBuffer> pair_buffers;
+    // thread, first pair and count of every particle's recorded neighbors
+    std::vector<int> pair_owner;
+    std::vector<int> pair_begin;
+    std::vector<int> pair_count;
+
+    /// Runs fn once for every particle spread across the pool, traced as the pass called name
+    ///
+    /// With work stealing the tasks are blocks of grid cells, otherwise equal ranges of particles. Templated
+    /// on the callable so each pass's body is inlined into the loop instead of called through std::function.
+    template <typename Fn>
+    void for_each_particle(const Fn& fn, const char* name);
+
+    /// Runs fn once for every grid cell spread across the pool, in blocks of cells with work stealing
+    template <typename Fn>
+    void for_each_cell(const Fn& fn, const char* name);
+
+    /// Runs fn once for every particle of every grid cell, one colour of cells at a time
+    ///
+    /// Cells share a colour when they are 2 * reach + 1 apart on both axes, so particles of cells running at the
+    /// same time have no neighbors within reach cells in common and can write to each other's sums directly
+    template <typename Fn>
+    void for_each_coloured_particle(int reach, const Fn& fn, const char* name);
+
+    /// Runs fn(i, thread, neighbors, count) for every particle with its neighbor candidates
+    template <typename Container, typename Fn>
+    void for_each_neighborhood(Container& c, const Fn& fn, const char* name);
+    /// With cell blocks the grid's candidates are gathered once per occupied cell and shared by its particles
+    template <typename Fn>
+    void for_each_neighborhood(GridContainer& c, const Fn& fn, const char* name);
+
+    /// Applies gravity, bounds and the particle's force, writing its next position and velocity
+    void integrate(int i);
+
+    /// Largest timestep the current velocities, forces and densities allow, within [min_timestep, max_timestep]
+    ///
+    /// The smallest of the CFL limit h / v, the force limit sqrt(h / a) and the explicit viscosity limit,
+    /// each scaled by courant. Forces are the previous step's, the first step only sees gravity.
+    float stable_timestep();
+
+    /// Density and force passes over each particle's full neighborhood from a container
+    ///
+    /// Instantiated once per container so the searches are called directly, with no per-pair dispatch
+    template <typename Container>
+    void full_passes(Container& c, const KernelSet& kernels, const KernelArgs& args);
+
+    /// Neighbor candidates of particle i, from the cached lists or gathered from a container into the thread's buffer
+    template <typename Container>
+    std::pair<const int*, int> neighbors_of(Container& c, int i, int thread);
+
+    /// Appends the particles within the smoothing radius of particle i
+    template <typename Container>
+    void gather(Container& c, int i, std::vector<int>& out);
+    /// Appends every particle in the grid cells around i, which the kernels filter themselves
+    void gather(GridContainer& c, int i, std::vector<int>& out);
 
 public:
     enum class Pattern {
@@ -27,13 +132,50 @@ public:
         Random
     };
 
-    Simulation() : smoothing_radius(0.15), timestep(0.005), gravity(1.0), gas_constant(0.02), viscosity(0.0),
-        target_density(6000.0), mass(1.0), spawn_pattern(Pattern::Grid), paused(true), particle_count(1000) {}
+    /// Container finding each particle's neighbors when neighbor lists are off
+    enum class Search {
+        Grid,
+        Hash,
+        BinaryPartition,
+        BruteForce
+    };
+
+    Simulation() : cell_tasks(false), steps(0), last_reorder(-1), list_builds(0), pairs(0), step_dt(0.0f), time(0.0),
+        smoothing_radius(0.15), timestep(0.005), gravity(1.0), gas_constant(0.02), viscosity(0.0),
+        target_density(6000.0), mass(1.0), spawn_pattern(Pattern::Grid), paused(true), particle_count(1000),
+        reorder_interval(20), threads(std::max(1u, std::thread::hardware_concurrency())), work_stealing(true),
+        neighbor_lists(false), skin(0.03), symmetric_forces(false), incremental_grid(true), cache_pairs(true), search(Search::Grid),
+        cell_blocks(true), adaptive_timestep(false), courant(0.4f), min_timestep(0.0001f), max_timestep(0.02f) {}
 
     /// Perform a physics update on all particles
     void phys_update();
 
-    ParticleContainer& get_particles();
+    /// Replaces all particles with particle_count new ones at rest in the spawn pattern
+    void reset();
+
+    ParticleStore& get_particles();
+    const ParticleStore& get_particles() const;
+
+    /// Worker pool used by the last update, null before the first one
+    const ThreadPool* get_pool() const;
+
+    /// Stops the worker pool so the next update starts new threads, which perf counters opened since then follow
+    void restart_pool();
+
+    /// Times the neighbor lists were rebuilt so far
+    int get_list_builds() const;
+
+    /// Candidate pairs handed to the density kernel by the last update, within the radius or not
+    long long get_pair_count() const;
+
+    /// Timestep taken by the last update, timestep itself unless it is adaptive
+    float get_step_timestep() const;
+
+    /// Physics updates performed so far
+    int get_steps() const;
+
+    /// Simulated seconds since the last reset
+    double get_time() const;
 
     // These fields are public so the imgui sliders can access them more easily
     float smoothing_radius;
@@ -46,6 +188,31 @@ public:
     Pattern spawn_pattern;
     bool paused;
     int particle_count;
+    // steps between Morton reorders of particle storage, 0 to disable
+    int reorder_interval;
+    // threads used by the particle passes
+    int threads;
+    // balance the neighbor passes by stealing blocks of cells instead of splitting particles evenly
+    bool work_stealing;
+    // reuse each particle's neighbors across steps until particles move more than skin / 2
+    bool neighbor_lists;
+    float skin;
+    // visit every pair once through half neighbor lists and apply its terms to both particles
+    bool symmetric_forces;
+    // only move the particles that changed grid cells, rebinning everything when too many did
+    bool incremental_grid;
+    // record each particle's neighbors and offsets in the density pass so the force pass doesn't search again
+    bool cache_pairs;
+    // neighbor lists and symmetric forces always search the grid
+    Search search;
+    // evaluate the grid a cell at a time, every particle of a cell against candidates gathered once for the cell
+    bool cell_blocks;
+    // choose each step's timestep from the stability limits instead of using timestep
+    bool adaptive_timestep;
+    // fraction of each stability limit the adaptive timestep goes up to
+    float courant;
+    float min_timestep;
+    float max_timestep;
 };
 
 #endif
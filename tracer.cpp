@@ -0,0 +1,113 @@
+#include "tracer.h"
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+/// Returns a thread's buffer to the tracer when the thread exits
+struct TraceThread
+{
+    TraceBuffer* buffer;
+
+    TraceThread() : buffer(nullptr) {}
+    ~TraceThread()
+    {
+        if (!buffer)
+            return;
+        Tracer& t = tracer();
+        std::lock_guard<std::mutex> lock(t.registry);
+        t.unused.push_back(buffer);
+    }
+};
+
+static thread_local TraceThread this_thread;
+
+Tracer::Tracer() : enabled(false), epoch(std::chrono::steady_clock::now())
+{
+}
+
+void Tracer::set_enabled(bool on)
+{
+    enabled.store(on, std::memory_order_relaxed);
+}
+
+TraceBuffer* Tracer::acquire()
+{
+    std::lock_guard<std::mutex> lock(registry);
+    if (!unused.empty())
+    {
+        TraceBuffer* b = unused.back();
+        unused.pop_back();
+        return b;
+    }
+    buffers.emplace_back(new TraceBuffer(buffers.size()));
+    return buffers.back().get();
+}
+
+void Tracer::record(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+    TraceBuffer*& b = this_thread.buffer;
+    if (!b)
+        b = acquire();
+
+    uint64_t n = b->written.load(std::memory_order_relaxed);
+    TraceEvent& e = b->events[n % TRACE_CAPACITY];
+    e.name = name;
+    e.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - epoch).count();
+    e.end = std::chrono::duration_cast<std::chrono::nanoseconds>(end - epoch).count();
+    b->written.store(n + 1, std::memory_order_release);
+}
+
+void Tracer::clear()
+{
+    std::lock_guard<std::mutex> lock(registry);
+    for (auto& b : buffers)
+        b->written.store(0, std::memory_order_relaxed);
+}
+
+static void write_escaped(std::ostream& out, const char* s)
+{
+    for (; *s; ++s)
+    {
+        if (*s == '"' || *s == '\\')
+            out << '\\';
+        out << *s;
+    }
+}
+
+bool Tracer::write_json(const std::string& path)
+{
+    std::ofstream out(path);
+    if (!out)
+        return false;
+
+    std::lock_guard<std::mutex> lock(registry);
+    out << std::fixed << std::setprecision(3);
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"FluidSim\"}}";
+
+    // complete events with microsecond timestamps, one lane per buffer
+    for (auto& b : buffers)
+    {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid
+            << ",\"args\":{\"name\":\"thread " << b->tid << "\"}}";
+
+        uint64_t written = b->written.load(std::memory_order_acquire);
+        uint64_t first = written > TRACE_CAPACITY ? written - TRACE_CAPACITY : 0;
+        for (uint64_t k=first; k<written; k++)
+        {
+            const TraceEvent& e = b->events[k % TRACE_CAPACITY];
+            out << ",\n{\"name\":\"";
+            write_escaped(out, e.name);
+            out << "\",\"cat\":\"fluidsim\",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid
+                << ",\"ts\":" << e.begin / 1000.0 << ",\"dur\":" << (e.end - e.begin) / 1000.0 << "}";
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+Tracer& tracer()
+{
+    static Tracer instance;
+    return instance;
+}
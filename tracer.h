@@ -0,0 +1,104 @@
+#ifndef FLUIDSIM_TRACER_H
+#define FLUIDSIM_TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// spans kept per thread, older ones are overwritten
+constexpr int TRACE_CAPACITY = 1 << 16;
+
+/// One span on a thread's timeline, nanoseconds since the tracer started
+struct TraceEvent
+{
+    const char* name;
+    int64_t begin;
+    int64_t end;
+};
+
+/// Ring of the spans recorded by one thread
+///
+/// Only the owning thread writes, so publishing a span is a store and a release increment of written
+struct TraceBuffer
+{
+    // lane shown in the trace, kept when the buffer passes to a new thread
+    int tid;
+    std::atomic<uint64_t> written;
+    TraceEvent events[TRACE_CAPACITY];
+
+    explicit TraceBuffer(int tid) : tid(tid), written(0) {}
+};
+
+/// Opt-in recorder of per-thread timelines, exported as Chrome trace event JSON
+///
+/// Recording takes no locks, the registry is only locked the first time a thread records and on export.
+/// The trace can be opened in chrome://tracing or ui.perfetto.dev.
+class Tracer
+{
+    std::atomic<bool> enabled;
+    std::chrono::steady_clock::time_point epoch;
+
+    std::mutex registry;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+    // buffers of threads that exited, handed to the next new thread
+    std::vector<TraceBuffer*> unused;
+
+    TraceBuffer* acquire();
+    friend struct TraceThread;
+
+public:
+    Tracer();
+
+    bool is_enabled() const { return enabled.load(std::memory_order_relaxed); }
+    void set_enabled(bool on);
+
+    /// Adds a span to the calling thread's timeline
+    void record(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+
+    /// Drops every span, only call while no other thread is recording
+    void clear();
+
+    /// Writes every span still in the rings, only call while no other thread is recording
+    bool write_json(const std::string& path);
+};
+
+/// Tracer shared by the simulation and the front ends
+Tracer& tracer();
+
+/// Records the time from construction to destruction as a span, if tracing was on at construction
+class TraceScope
+{
+    const char* name;
+    bool active;
+    std::chrono::steady_clock::time_point begin;
+
+public:
+    explicit TraceScope(const char* name) : name(name), active(tracer().is_enabled())
+    {
+        if (active)
+            begin = std::chrono::steady_clock::now();
+    }
+    ~TraceScope()
+    {
+        if (active)
+            tracer().record(name, begin, std::chrono::steady_clock::now());
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// spans the rest of the enclosing scope, compiled out entirely unless FLUIDSIM_PROFILING is defined
+#ifdef FLUIDSIM_PROFILING
+#define FLUIDSIM_TRACE_CONCAT_(a, b) a##b
+#define FLUIDSIM_TRACE_CONCAT(a, b) FLUIDSIM_TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope FLUIDSIM_TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#endif
+
+#endif